@@ -126,13 +126,15 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* NULL for every address space */
+	vaddr_t ts_page;		/* TS_ALLPAGES for all of ts_as */
 };
 
+#define TS_ALLPAGES ((vaddr_t)1)
+
 #define TLBSHOOTDOWN_MAX 16
 
 
@@ -41,6 +41,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /* in exception-*.S */
@@ -233,6 +234,17 @@ mips_trap(struct trapframe *tf)
 		goto done;
 	}
 
+	/*
+	 * TLB miss on a page that is already in memory? Reload it
+	 * without going through the rest of vm_fault.
+	 */
+#if !OPT_DUMBVM
+	if ((code == EX_TLBL || code == EX_TLBS) &&
+	    vm_tlbrefill(tf->tf_vaddr, code == EX_TLBS) == 0) {
+		goto done;
+	}
+#endif
+
 	/*
 	 * Ok, it wasn't any of the really easy cases.
 	 * Call vm_fault on the TLB exceptions.
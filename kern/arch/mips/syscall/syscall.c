@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -142,6 +143,40 @@ syscall(struct trapframe *tf)
 		err = sys_getpid(&retval);
 		break;
 
+#if !OPT_DUMBVM
+	    /* memory calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The 64-bit offset can't go in a3 on its own,
+			 * so it's on the stack like lseek's whence.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(off_t));
+			if (err) {
+				break;
+			}
+			err = sys_mmap(
+				tf->tf_a0,
+				tf->tf_a1,
+				tf->tf_a2,
+				offset,
+				&retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+#endif
+
 
 	    /* file calls */
 
@@ -854,10 +854,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, off_t offset, size_t len)
 {
 	(void)v;
-	return ENOSYS;
+	(void)len;
+
+	if (offset < 0) {
+		return EINVAL;
+	}
+	return 0;
 }
 
 //////////////////////////////
@@ -1073,6 +1078,16 @@ emufs_truncate_isdir(struct vnode *v, off_t len)
 	return ENOTDIR;
 }
 
+static
+int
+emufs_mmap_isdir(struct vnode *v, off_t offset, size_t len)
+{
+	(void)v;
+	(void)offset;
+	(void)len;
+	return EISDIR;
+}
+
 //////////////////////////////
 
 /*
@@ -1127,7 +1142,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
-	.vop_mmap = emufs_void_op_isdir,
+	.vop_mmap = emufs_mmap_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
 
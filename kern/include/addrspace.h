@@ -39,6 +39,16 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct pte;
+
+// RLIMIT_STACK given to new address spaces, and the most it can be set to
+#define STACK_LIMIT_DEFAULT (256 * PAGE_SIZE)
+#define STACK_LIMIT_MAX     (16384 * PAGE_SIZE)
+
+// protection flags for mmap(), the same as in userland <unistd.h>
+#define PROT_READ  1
+#define PROT_WRITE 2
 
 
 /*
@@ -52,8 +62,11 @@ struct region {
 	vaddr_t base;
 	size_t size;
 	bool write;
-	bool modified;
-	struct region *next;
+	struct vnode *vnode;	// file the contents come from, or NULL
+	vaddr_t filebase;	// address of the first byte from the file
+	off_t offset;		// where that byte is in the file
+	size_t filesize;	// bytes from the file, the rest is zero-filled
+	bool mapped;		// made by mmap(), writes go back to the file
 };
 
 struct addrspace {
@@ -67,7 +80,18 @@ struct addrspace {
 	paddr_t as_stackpbase;
 #else
 	vaddr_t stack_end;
-	struct region *start;
+	vaddr_t stack_start;		// lowest stack page touched so far
+	size_t stack_limit;		// RLIMIT_STACK, how far the stack may grow
+	vaddr_t heap_start;		// page after the highest region
+	vaddr_t heap_end;		// the break, moved by sbrk()
+	struct region **regions;	// sorted by base address
+	unsigned nregions;
+	unsigned maxregions;		// allocated size of regions[]
+	struct region *lastregion;	// region of the last as_findregion() hit
+	struct pte **pagetable;		// page table directory, see vm.c
+	struct lock *pt_lock;		// protects the page table
+	uint32_t asid;			// address space ID and its generation, see vm.c
+	unsigned vmstats[VMS_NUM];	// events in this address space, see vm_count()
 #endif
 };
 
@@ -108,10 +132,27 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - make the region at VADDR load its first FILESIZE
+ *                bytes from file V at OFFSET when they are first touched.
+ *
+ *    as_findregion - return the region containing VADDR, or NULL if
+ *                there isn't one.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, handing back
+ *                the old end. Pages given up are freed straight away.
+ *
+ *    as_mmap   - make a new zero-filled region of LENGTH bytes between
+ *                the heap and the stack and hand back its address. Use
+ *                as_define_file to back it with a file.
+ *
+ *    as_munmap - remove a region made by as_mmap, writing modified
+ *                pages of a writable file mapping back to the file.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
 
+void              as_bootstrap(void);
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
@@ -126,6 +167,15 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t length, bool write,
+                          vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr);
 
 
 /*
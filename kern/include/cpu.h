@@ -35,6 +35,15 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct addrspace;
+
+/* Number of free frames each cpu can keep to itself; see frametable.c */
+#define CPU_FRAMES 16
+
+/* Free kmalloc blocks each cpu can keep of each size; see kmalloc.c */
+#define CPU_KSIZES 8
+#define CPU_KBLOCKS 8
+
 
 /*
  * Per-cpu structure
@@ -62,6 +71,38 @@ struct cpu {
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * Free single frames cached so that most calls to
+	 * alloc_kpages(1) and free_kpages() don't need the global
+	 * frame table lock. Holds frame table indexes.
+	 */
+	unsigned c_frames[CPU_FRAMES];
+	unsigned c_numframes;		/* Number of frames in c_frames[] */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * Free kernel heap blocks of each size, kept so that most
+	 * calls to kmalloc() and kfree() of small blocks don't need
+	 * the global kmalloc lock.
+	 */
+	void *c_kblocks[CPU_KSIZES][CPU_KBLOCKS];
+	unsigned c_numkblocks[CPU_KSIZES];
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * The address space ID the TLB matches against (in TLBHI_PID
+	 * position), the address space it was given to, and the ID
+	 * generation of the entries this cpu's TLB may hold; see
+	 * vm_activate in vm.c.
+	 */
+	uint32_t c_asid;
+	struct addrspace *c_vmspace;
+	uint32_t c_asidgen;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -155,6 +196,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends the same shootdown to all CPUs
+ * except the current one and returns how many it sent; call it with
+ * interrupts off so the current CPU can't change underneath it.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +213,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -64,10 +64,11 @@
 
 /* Max bytes for an exec function (should be at least 16K) */
 /*
- * UNSW Note: We use max 4K to avoid the frametable allocator needing
- * to deal with greater than 4K allocations
+ * UNSW Note: This was 4K while the frame table could only allocate
+ * single pages. kmalloc now gets exact multi-page extents, so it's
+ * back to the usual 64K.
  */
-#define __ARG_MAX       (4 * 1024)
+#define __ARG_MAX       (64 * 1024)
 
 /*
  * Important for system behavior, but not a big part of the API.
@@ -0,0 +1,54 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches for kernel structures that are allocated and freed
+ * often.
+ *
+ * A cache hands out objects of one size, packed into whole pages
+ * without rounding up to a kmalloc size class. The constructor runs
+ * once, the first time an object is handed out, and the destructor
+ * only when its page goes back to the system; in between, a freed
+ * object keeps whatever the constructor set up (typically locks and
+ * CVs), so the next user doesn't have to create them again. Objects
+ * must therefore be freed in their constructed state.
+ *
+ * The constructor returns 0 or an error code; if it fails,
+ * kmem_cache_alloc returns NULL. Either function may be NULL.
+ *
+ * Objects must be smaller than about half a page.
+ */
+
+#include <spinlock.h>
+
+struct kmem_slab;		/* Opaque */
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;			/* Object size as given */
+	size_t kc_stride;		/* Bytes each object takes in a slab */
+	unsigned kc_perslab;		/* Objects in each slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct spinlock kc_lock;	/* Lock for the rest */
+	struct kmem_slab *kc_slabs;	/* Slabs with room for more */
+	unsigned kc_nslabs;		/* Slabs in total */
+	unsigned kc_nempty;		/* Slabs with nothing in use */
+	unsigned kc_inuse;		/* Objects handed out */
+	unsigned kc_allocs;		/* Calls to kmem_cache_alloc */
+	unsigned kc_ctors;		/* Objects constructed */
+	struct kmem_cache *kc_next;	/* All caches, for kmem_cache_printstats */
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+/* Print usage of every cache; used by the "kh" menu command */
+void kmem_cache_printstats(void);
+
+#endif /* _KMEMCACHE_H_ */
@@ -125,6 +125,10 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_printprofile and printsites report what the always-on sampling
+ * profiler has seen; kheap_setsampling sets how many small allocations
+ * each sample stands for, or 0 to stop sampling.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +136,10 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_printprofile(void);
+void kheap_printsites(void);
+void kheap_setsampling(unsigned period);
+unsigned kheap_getsampling(void);
 
 /*
  * C string functions.
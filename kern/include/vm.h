@@ -58,10 +58,112 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
-void vm_freeproc(uint32_t pid);
+struct addrspace;
 
-int vm_cloneproc(uint32_t oldpid, uint32_t newpid);
+/*
+ * VM events counted per cpu and per address space, see vm_count() in
+ * vm.c. The names are in vm_eventnames[].
+ */
+enum vm_event {
+	VMS_TLBMISS,		// TLB misses on user addresses
+	VMS_REFILL,		// of those, refilled without vm_fault()
+	VMS_FAULT_READ,		// vm_fault() calls by fault type
+	VMS_FAULT_WRITE,
+	VMS_FAULT_READONLY,
+	VMS_ZEROFILL,		// new pages that start out zero
+	VMS_FILEREAD,		// new pages read from a file
+	VMS_CACHEHIT,		// new pages found in the page cache
+	VMS_RUN,		// superpage runs allocated
+	VMS_SWAPIN,		// pages read back from swap
+	VMS_SWAPOUT,		// evicted pages written to swap
+	VMS_DROP,		// evicted pages that were clean
+	VMS_COPY,		// copy-on-write copies
+	VMS_NUM
+};
+
+/* Print VM counters and frame use, and per process summaries at exit */
+void vm_printstats(void);
+void vm_setexitstats(bool enabled);
+void vm_printproc(const char *name, struct addrspace *as);
+
+/* Per address space page tables */
+int vm_initproc(struct addrspace *as);
+void vm_freeproc(struct addrspace *as);
+int vm_cloneproc(struct addrspace *old, struct addrspace *new);
+void vm_freerange(struct addrspace *as, vaddr_t start, vaddr_t end);
+struct region;
+int vm_writeback(struct addrspace *as, struct region *reg);
+
+/* Reload the TLB for a page already in memory, without vm_fault() */
+int vm_tlbrefill(vaddr_t faultaddress, bool writing);
+
+/* Fault-around: pages after a miss also loaded into the TLB */
+int vm_setfaultaround(unsigned window);
+void vm_printfaultaround(void);
+
+/* Superpages: aligned runs of contiguous frames for large anonymous areas */
+void vm_setsuperpages(bool enabled);
+void vm_printsuperpages(void);
+
+/* Stack limit (RLIMIT_STACK) of new address spaces, in bytes */
+int vm_setstacklimit(size_t limit);
+size_t vm_getstacklimit(void);
+
+/* Tag the TLB with the address space ID of an address space, see vm.c */
+void vm_activate(struct addrspace *as);
+
+/*
+ * Invalidate the whole TLB of the current cpu, or one page of an address
+ * space in the TLB of every cpu (everything if the address space is
+ * NULL); the latter may sleep.
+ */
+void vm_tlbflush(void);
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t page);
 
 void ft_bootstrap(void);
 
+/* Reference counts for frames shared copy-on-write between processes */
+void ft_incref(vaddr_t addr);
+unsigned ft_refcount(vaddr_t addr);
+
+/* User page frames, and finding one to evict when memory runs low */
+vaddr_t alloc_upage(void);
+vaddr_t alloc_urun(unsigned order);
+void ft_setowner(vaddr_t addr, uint32_t pid, vaddr_t page);
+bool ft_touch(vaddr_t addr, bool write);
+bool ft_dirty(vaddr_t addr);
+bool ft_refill(vaddr_t addr, uint32_t pid, vaddr_t page, bool *dirty);
+bool ft_prefetch(vaddr_t addr, uint32_t pid, vaddr_t page, bool *dirty);
+void ft_prefetchstats(unsigned *count, unsigned *missed);
+vaddr_t ft_victim(uint32_t *pid, vaddr_t *page);
+
+/* Page replacement policies: "fifo", "clock" and "eclock" */
+int ft_setpolicy(const char *name);
+void ft_printpolicies(void);
+
+/* Hits and misses of the pool of frames zeroed in the background */
+void ft_printzerostats(void);
+
+/* Frames free, cached and in use */
+void ft_printstats(void);
+
+/* Page cache sharing read-only file pages between processes */
+struct vnode;
+void pc_bootstrap(void);
+vaddr_t pc_lookup(struct vnode *vn, off_t offset, unsigned window);
+unsigned pc_stamp(void);
+vaddr_t pc_insert(struct vnode *vn, off_t offset, unsigned window,
+		  vaddr_t frame, unsigned stamp);
+void pc_invalidate(struct vnode *vn);
+bool pc_reclaim(void);
+void pc_printstats(void);
+
+/* Swap space on a raw disk, in page sized slots */
+#define SWAP_NOSLOT 0x7fffffff	// fits the 31 bits a page table entry has
+void swap_bootstrap(void);
+int swap_out(vaddr_t frame, unsigned *slot);
+int swap_in(unsigned slot, vaddr_t frame);
+int swap_dup(unsigned slot, unsigned *newslot);
+void swap_free(unsigned slot);
+
 #endif /* _VM_H_ */
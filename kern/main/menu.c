@@ -45,8 +45,11 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <kmemcache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -467,6 +470,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 
 	return 0;
 }
@@ -500,6 +504,167 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printprofile();
+
+	return 0;
+}
+
+static
+int
+cmd_kheapsites(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printsites();
+
+	return 0;
+}
+
+static
+int
+cmd_kheapsampling(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Sampling 1 in %u kmalloc calls (0 is off)\n",
+			kheap_getsampling());
+		return 0;
+	}
+	else if (nargs == 2) {
+		kheap_setsampling(atoi(args[1]));
+		return 0;
+	}
+
+	kprintf("Usage: khsample [period]\n");
+	return EINVAL;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs == 1) {
+		ft_printpolicies();
+		return 0;
+	}
+	else if (nargs == 2) {
+		if (ft_setpolicy(args[1])) {
+			kprintf("Unknown page replacement policy %s\n", args[1]);
+			return EINVAL;
+		}
+		return 0;
+	}
+
+	kprintf("Usage: vmpolicy [fifo|clock|eclock]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printfaultaround();
+		return 0;
+	}
+	else if (nargs == 2) {
+		if (vm_setfaultaround(atoi(args[1]))) {
+			kprintf("Fault-around window too large\n");
+			return EINVAL;
+		}
+		return 0;
+	}
+
+	kprintf("Usage: fa [window]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats();
+		return 0;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "exit") &&
+		 !strcmp(args[2], "on")) {
+		vm_setexitstats(true);
+		return 0;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "exit") &&
+		 !strcmp(args[2], "off")) {
+		vm_setexitstats(false);
+		return 0;
+	}
+
+	kprintf("Usage: vm [exit on|off]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_superpages(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printsuperpages();
+		return 0;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_setsuperpages(true);
+		return 0;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_setsuperpages(false);
+		return 0;
+	}
+
+	kprintf("Usage: sp [on|off]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Stack limit for new processes: %u pages\n",
+			vm_getstacklimit() / PAGE_SIZE);
+		return 0;
+	}
+	else if (nargs == 2) {
+		if (vm_setstacklimit(atoi(args[1]) * PAGE_SIZE)) {
+			kprintf("Stack limit out of range\n");
+			return EINVAL;
+		}
+		return 0;
+	}
+
+	kprintf("Usage: stack [pages]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_zerostats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	ft_printzerostats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -606,6 +771,17 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap size classes   ",
+	"[khsites] Kernel heap call sites    ",
+	"[khsample] Heap sampling period     ",
+#if !OPT_DUMBVM
+	"[vm] VM statistics                  ",
+	"[vmpolicy] Page replacement policy  ",
+	"[zp] Pre-zeroed page pool stats     ",
+	"[fa] Fault-around window and stats  ",
+	"[stack] Stack limit in pages        ",
+	"[sp] Superpage runs on/off and stats",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +833,17 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+	{ "khsites",    cmd_kheapsites },
+	{ "khsample",   cmd_kheapsampling },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "vmpolicy",   cmd_vmpolicy },
+	{ "zp",         cmd_zerostats },
+	{ "fa",         cmd_faultaround },
+	{ "stack",      cmd_stacklimit },
+	{ "sp",         cmd_superpages },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -52,12 +52,45 @@
 #include <vnode.h>
 #include <pid.h>
 #include <filetable.h>
+#include <kmemcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Cache of proc structures. A cached proc keeps its threads lock,
+ * threads array and p_lock between uses.
+ */
+static struct kmem_cache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_threadslock = lock_create("p_threads");
+	if (proc->p_threadslock == NULL) {
+		return ENOMEM;
+	}
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	threadarray_cleanup(&proc->p_threads);
+	lock_destroy(proc->p_threadslock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -67,25 +100,16 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->p_threadslock = lock_create("p_threads");
-	if (proc->p_threadslock == NULL) {
-		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
-	threadarray_init(&proc->p_threads);
 
-	spinlock_init(&proc->p_lock);
 	proc->p_pid = INVALID_PID;
 
 	/* VM fields */
@@ -183,12 +207,10 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
-	spinlock_cleanup(&proc->p_lock);
-	threadarray_cleanup(&proc->p_threads);
-	lock_destroy(proc->p_threadslock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -197,6 +219,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("Out of memory creating proc cache\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -366,6 +394,11 @@ proc_exit(int status)
 	/* There should be no threads left in the target process. */
 	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
+#if !OPT_DUMBVM
+	/* Report what the VM system did for it, if turned on. */
+	vm_printproc(proc->p_name, proc->p_addrspace);
+#endif
+
 	/* Now we can destroy the process. */
 	proc_destroy(proc);
 
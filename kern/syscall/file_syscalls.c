@@ -45,6 +45,7 @@
 #include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 #include <openfile.h>
 #include <filetable.h>
 #include <syscall.h>
@@ -149,6 +150,10 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	result = (rw == UIO_READ) ?
 		VOP_READ(file->of_vnode, &useruio) :
 		VOP_WRITE(file->of_vnode, &useruio);
+	if (rw == UIO_WRITE) {
+		/* Even a failed write may have changed cached pages. */
+		pc_invalidate(file->of_vnode);
+	}
 	if (result) {
 		goto fail;
 	}
@@ -45,6 +45,7 @@
 #include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 #include <openfile.h>
 #include <filetable.h>
 #include <syscall.h>
@@ -424,6 +425,7 @@ sys_ftruncate(int fd, off_t len)
 	 */
 
 	err = VOP_TRUNCATE(file->of_vnode, len);
+	pc_invalidate(file->of_vnode);
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
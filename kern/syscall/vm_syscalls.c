@@ -0,0 +1,134 @@
+/*
+ * Memory-related syscalls. Only built with the full VM system, not
+ * with dumbvm.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+
+/*
+ * sys_sbrk
+ * Returns the old break, which is where the new memory starts when
+ * growing.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as = proc_getas();
+	vaddr_t oldbreak;
+	int result;
+
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/*
+ * sys_mmap
+ * Maps LENGTH bytes of the file open on FD, starting at OFFSET, or
+ * zero-filled memory if FD is -1. Nothing is read in until the pages
+ * are touched. OFFSET has to be page aligned.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval)
+{
+	struct addrspace *as = proc_getas();
+	struct openfile *file = NULL;
+	size_t filesize = 0;
+	vaddr_t addr;
+	int result;
+
+	if (as == NULL) {
+		return EFAULT;
+	}
+	if (length == 0 || (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+	if (offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	if (fd != -1) {
+		struct stat st;
+
+		result = filetable_get(curproc->p_filetable, fd, &file);
+		if (result) {
+			return result;
+		}
+		/* pages are read in, and written back if writable */
+		if (file->of_accmode == O_WRONLY ||
+		    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+			result = EACCES;
+			goto fail;
+		}
+		result = VOP_MMAP(file->of_vnode, offset, length);
+		if (result) {
+			goto fail;
+		}
+		result = VOP_STAT(file->of_vnode, &st);
+		if (result) {
+			goto fail;
+		}
+		/* past the end of the file the mapping is zero-filled */
+		if (st.st_size > offset) {
+			filesize = st.st_size - offset < (off_t)length ?
+				st.st_size - offset : length;
+		}
+	}
+
+	result = as_mmap(as, length, (prot & PROT_WRITE) != 0, &addr);
+	if (result) {
+		goto fail;
+	}
+	if (file != NULL) {
+		result = as_define_file(as, addr, file->of_vnode, offset,
+					filesize);
+		if (result) {
+			as_munmap(as, addr);
+			goto fail;
+		}
+		filetable_put(curproc->p_filetable, fd, file);
+	}
+
+	*retval = (int32_t)addr;
+	return 0;
+
+fail:
+	if (file != NULL) {
+		filetable_put(curproc->p_filetable, fd, file);
+	}
+	return result;
+}
+
+/*
+ * sys_munmap
+ * ADDR has to be an address returned by mmap; the whole mapping goes.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as = proc_getas();
+
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_munmap(as, (vaddr_t)addr);
+}
@@ -237,15 +237,25 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Block devices can be mapped, within their size, since the
+ * mapping is paged with dev_read and dev_write. Character devices
+ * can't.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t offset, size_t len)
 {
-	(void)v;
-	return ENOSYS;
+	struct device *d = v->vn_data;
+	off_t size;
+
+	if (d->d_blocks == 0) {
+		return ENODEV;
+	}
+	size = (off_t)d->d_blocks * d->d_blocksize;
+	if (offset < 0 || offset >= size || (off_t)len > size - offset) {
+		return EINVAL;
+	}
+	return 0;
 }
 
 /*
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 
 
 /* Does most of the work for open(). */
@@ -99,6 +100,8 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 		else {
 			result = VOP_TRUNCATE(vn, 0);
+			/* Don't let exec or mmap see the old pages. */
+			pc_invalidate(vn);
 		}
 		if (result) {
 			VOP_DECREF(vn);
@@ -36,6 +36,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 
 /*
  * Initialize an abstract vnode.
@@ -52,6 +53,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_cachedpages = 0;
 	return 0;
 }
 
@@ -113,6 +115,8 @@ vnode_decref(struct vnode *vn)
 	spinlock_release(&vn->vn_countlock);
 
 	if (destroy) {
+		/* The page cache doesn't hold references; drop its pages. */
+		pc_invalidate(vn);
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
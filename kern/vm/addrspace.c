@@ -35,11 +35,19 @@
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
+#include <vnode.h>
 #include <vm.h>
 #include <proc.h>
+#include <kmemcache.h>
 
 #define NUMSTACK 16
 
+// initial size of the region array, doubled when it fills up
+#define NUMREGIONS 4
+
+// regions come from their own cache rather than a kmalloc size class
+static struct kmem_cache *region_cache;
+
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -50,6 +58,171 @@
  *
  */
 
+/* Initialization function, called from vm_bootstrap() */
+void
+as_bootstrap(void)
+{
+	region_cache = kmem_cache_create("region", sizeof(struct region),
+					 NULL, NULL);
+	if (region_cache == NULL) {
+		panic("addrspace.c: out of memory in bootstrap\n");
+	}
+}
+
+// inserts a region into the array, keeping it sorted by base address
+static
+int
+as_addregion(struct addrspace *as, struct region *reg)
+{
+	if (as->nregions == as->maxregions) {
+		unsigned newmax = as->maxregions ? as->maxregions * 2 : NUMREGIONS;
+		struct region **newregions = kmalloc(sizeof(struct region *) * newmax);
+		if (newregions == NULL) {
+			return ENOMEM;
+		}
+		for (unsigned i = 0; i < as->nregions; i++) {
+			newregions[i] = as->regions[i];
+		}
+		kfree(as->regions);
+		as->regions = newregions;
+		as->maxregions = newmax;
+	}
+
+	unsigned i = as->nregions;
+	while (i > 0 && as->regions[i - 1]->base > reg->base) {
+		as->regions[i] = as->regions[i - 1];
+		i--;
+	}
+	as->regions[i] = reg;
+	as->nregions++;
+	return 0;
+}
+
+// removes a region from the array, keeping the rest in order
+static
+void
+as_delregion(struct addrspace *as, struct region *reg)
+{
+	unsigned i = 0;
+	while (as->regions[i] != reg) {
+		i++;
+		KASSERT(i < as->nregions);
+	}
+	as->nregions--;
+	for (; i < as->nregions; i++) {
+		as->regions[i] = as->regions[i + 1];
+	}
+	if (as->lastregion == reg) {
+		as->lastregion = NULL;
+	}
+}
+
+// frees an address space without writing back its file mappings, for
+// as_destroy() and for a copy that failed half way, whose pages belong
+// to the parent
+static
+void
+as_free(struct addrspace *as)
+{
+	// freeing each region
+	for (unsigned i = 0; i < as->nregions; i++) {
+		if (as->regions[i]->vnode != NULL) {
+			VOP_DECREF(as->regions[i]->vnode);
+		}
+		kmem_cache_free(region_cache, as->regions[i]);
+	}
+	kfree(as->regions);
+
+	vm_freeproc(as);
+
+	kfree(as);
+}
+
+// the lowest address the stack may grow down to, less an unmapped guard
+// page so that overflowing it faults instead of running into other memory
+static
+vaddr_t
+as_stackfloor(struct addrspace *as)
+{
+	return as->stack_end - as->stack_limit - PAGE_SIZE;
+}
+
+// the lowest address in use above the heap, which it can't grow past
+static
+vaddr_t
+as_heaplimit(struct addrspace *as)
+{
+	for (unsigned i = 0; i < as->nregions; i++) {
+		if (as->regions[i]->base >= as->heap_start) {
+			return as->regions[i]->base;
+		}
+	}
+	return as_stackfloor(as);
+}
+
+/*
+ * Finds the highest free range of SIZE bytes between the heap and the
+ * stack, so mappings are packed down from the stack and leave the heap
+ * as much room to grow as possible.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t size, vaddr_t *addr)
+{
+	vaddr_t top = as_stackfloor(as);
+	vaddr_t bottom = (as->heap_end + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	for (unsigned i = as->nregions; i > 0; i--) {
+		struct region *reg = as->regions[i - 1];
+		vaddr_t end = reg->base + reg->size;
+		if (end <= bottom) {
+			// the rest are below the heap
+			break;
+		}
+		if (end <= top && top - end >= size) {
+			break;
+		}
+		if (reg->base < top) {
+			top = reg->base;
+		}
+	}
+	if (top < bottom || top - bottom < size) {
+		return ENOMEM;
+	}
+	*addr = top - size;
+	return 0;
+}
+
+/*
+ * Finds the region containing an address. Faults tend to hit the same
+ * region over and over, so the last one found is checked first, then
+ * the sorted array is binary searched.
+ */
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *reg = as->lastregion;
+	if (reg != NULL && vaddr >= reg->base && vaddr - reg->base < reg->size) {
+		return reg;
+	}
+
+	unsigned lo = 0;
+	unsigned hi = as->nregions;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		reg = as->regions[mid];
+		if (vaddr < reg->base) {
+			hi = mid;
+		} else if (vaddr - reg->base >= reg->size) {
+			lo = mid + 1;
+		} else {
+			as->lastregion = reg;
+			return reg;
+		}
+	}
+	return NULL;
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -61,7 +234,23 @@ as_create(void)
 	}
 
 	as->stack_end = USERSTACK;
-	as->start = NULL;
+	as->stack_start = USERSTACK;
+	as->stack_limit = vm_getstacklimit();
+	as->heap_start = 0;
+	as->heap_end = 0;
+	as->regions = NULL;
+	as->nregions = 0;
+	as->maxregions = 0;
+	as->lastregion = NULL;
+	as->asid = 0;
+	for (unsigned i = 0; i < VMS_NUM; i++) {
+		as->vmstats[i] = 0;
+	}
+
+	if (vm_initproc(as)) {
+		kfree(as);
+		return NULL;
+	}
 
 	return as;
 }
@@ -77,36 +266,33 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 
 	newas->stack_end = old->stack_end;
-	newas->start = NULL;
+	newas->stack_start = old->stack_start;
+	newas->stack_limit = old->stack_limit;
+	newas->heap_start = old->heap_start;
+	newas->heap_end = old->heap_end;
 
 	// copying each region
-	struct region *currOld = old->start;
-	struct region *currNew = NULL;
-	while (currOld != NULL) {
-		struct region *new = kmalloc(sizeof(struct region));
+	for (unsigned i = 0; i < old->nregions; i++) {
+		struct region *new = kmem_cache_alloc(region_cache);
 		if (new == NULL) {
-			as_destroy(newas);
+			as_free(newas);
 			return ENOMEM;
 		}
-		new->base = currOld->base;
-		new->size = currOld->size;
-		new->write = currOld->write;
-		new->modified = currOld->modified;
-		new->next = NULL;
-		// is newas has no start
-		if (newas->start == NULL) {
-			newas->start = new;
-			currNew = new;
-			currOld = currOld->next;
-			continue;
+		*new = *old->regions[i];
+		if (new->vnode != NULL) {
+			VOP_INCREF(new->vnode);
+		}
+		// regions are already sorted, so this only ever appends
+		int result = as_addregion(newas, new);
+		if (result) {
+			kmem_cache_free(region_cache, new);
+			as_free(newas);
+			return result;
 		}
-		currNew->next = new;
-		currNew = currNew->next;
-		currOld = currOld->next;
 	}
-	int result = vm_cloneproc((uint32_t) old, (uint32_t) newas);
+	int result = vm_cloneproc(old, newas);
 	if (result) {
-		as_destroy(newas);
+		as_free(newas);
 		return result;
 	}
 
@@ -119,24 +305,20 @@ as_destroy(struct addrspace *as)
 {
 	if (as == NULL) return;
 
-	// freeing each region
-	struct region *curr = as->start;
-	while (curr != NULL) {
-		struct region *del = curr;
-		curr = curr->next;
-		kfree(del);
+	// exiting unmaps file mappings, so their changes are written back
+	for (unsigned i = 0; i < as->nregions; i++) {
+		struct region *reg = as->regions[i];
+		if (reg->mapped && reg->vnode != NULL && reg->write) {
+			vm_writeback(as, reg);
+		}
 	}
 
-	vm_freeproc((uint32_t) as);
-
-	kfree(as);
+	as_free(as);
 }
 
 void
 as_activate(void)
 {
-	/* Copied from dumbvm.c */
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -144,14 +326,8 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	// entries of other address spaces are told apart by their ID
+	vm_activate(as);
 }
 
 void
@@ -179,7 +355,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
                  int readable, int writeable, int executable)
 {
 	if (as == NULL) return EFAULT;
-	if (vaddr + memsize >= as->stack_end) return ENOMEM;
+	if (vaddr + memsize > as_stackfloor(as)) return ENOMEM;
 
 	// page alignment code from dumbvm.c
 	/* Align the region. First, the base... */
@@ -189,21 +365,34 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	/* ...and now the length. */
 	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	struct region *new = kmalloc(sizeof(struct region));
+	struct region *new = kmem_cache_alloc(region_cache);
 	if (new == NULL) {
 		return ENOMEM;
 	}
 
 	new->base = vaddr;
 	new->size = memsize;
-	new->modified = false;
+	new->vnode = NULL;
+	new->filebase = 0;
+	new->offset = 0;
+	new->filesize = 0;
+	new->mapped = false;
 	if (writeable == 2) {
 		new->write = true;
 	} else {
 		new->write = false;
 	}
-	new->next = as->start;
-	as->start = new;
+	int result = as_addregion(as, new);
+	if (result) {
+		kmem_cache_free(region_cache, new);
+		return result;
+	}
+
+	// the heap starts out empty, just above the highest region
+	if (vaddr + memsize > as->heap_start) {
+		as->heap_start = vaddr + memsize;
+		as->heap_end = as->heap_start;
+	}
 
 	// unused
 	(void) readable;
@@ -217,16 +406,7 @@ as_prepare_load(struct addrspace *as)
 {
 	if (as == NULL) return EFAULT;
 
-	struct region *curr = as->start;
-	while (curr != NULL) {
-		// check if not writable
-		if (curr->write == false) {
-			curr->write = true;
-			curr->modified = true;
-		}
-		curr = curr->next;
-	}
-
+	// nothing to do, pages are read in from the file by vm_fault()
 	return 0;
 }
 
@@ -235,16 +415,6 @@ as_complete_load(struct addrspace *as)
 {
 	if (as == NULL) return EFAULT;
 
-	struct region *curr = as->start;
-	while (curr != NULL) {
-		// check if writable and modified
-		if (curr->write == true && curr->modified == true) {
-			curr->write = false;
-			curr->modified = false;
-		}
-		curr = curr->next;
-	}
-
 	return 0;
 }
 
@@ -259,3 +429,128 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Backs the start of the region containing VADDR with part of a file.
+ * Nothing is read now; vm_fault() reads each page on its first touch,
+ * and anything past FILESIZE is left zero-filled.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+               off_t offset, size_t filesize)
+{
+	if (as == NULL) return EFAULT;
+
+	struct region *reg = as_findregion(as, vaddr);
+	if (reg == NULL || reg->vnode != NULL) {
+		return EINVAL;
+	}
+	if (filesize > reg->base + reg->size - vaddr) {
+		return EINVAL;
+	}
+
+	VOP_INCREF(v);
+	reg->vnode = v;
+	reg->filebase = vaddr;
+	reg->offset = offset;
+	reg->filesize = filesize;
+
+	return 0;
+}
+
+/*
+ * Moves the break. Growing the heap only moves heap_end; vm_fault()
+ * zero-fills each new page when it is first touched. Shrinking it frees
+ * every page wholly above the new break at once.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	if (as == NULL) return EFAULT;
+
+	vaddr_t old = as->heap_end;
+	// negate after the cast, -amount overflows for INTPTR_MIN
+	if (amount < 0 && -(vaddr_t)amount > old - as->heap_start) {
+		return EINVAL;
+	}
+	if (amount > 0 && (vaddr_t)amount > as_heaplimit(as) - old) {
+		// would run into a mapping or the stack
+		return ENOMEM;
+	}
+
+	vaddr_t new = old + amount;
+	if (amount < 0) {
+		vm_freerange(as, (new + PAGE_SIZE - 1) & PAGE_FRAME,
+			(old + PAGE_SIZE - 1) & PAGE_FRAME);
+	}
+	as->heap_end = new;
+	*oldbreak = old;
+	return 0;
+}
+
+// makes a new anonymous region for mmap(), as_define_file() can back it
+// with a file afterwards
+int
+as_mmap(struct addrspace *as, size_t length, bool write, vaddr_t *addr)
+{
+	if (as == NULL) return EFAULT;
+	if (length == 0) return EINVAL;
+
+	size_t size = (length + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (size < length) {
+		return ENOMEM;
+	}
+	vaddr_t base;
+	int result = as_findgap(as, size, &base);
+	if (result) {
+		return result;
+	}
+
+	struct region *new = kmem_cache_alloc(region_cache);
+	if (new == NULL) {
+		return ENOMEM;
+	}
+	new->base = base;
+	new->size = size;
+	new->write = write;
+	new->vnode = NULL;
+	new->filebase = 0;
+	new->offset = 0;
+	new->filesize = 0;
+	new->mapped = true;
+	result = as_addregion(as, new);
+	if (result) {
+		kmem_cache_free(region_cache, new);
+		return result;
+	}
+
+	*addr = base;
+	return 0;
+}
+
+/*
+ * Removes a region made by as_mmap(). The region goes even if writing
+ * it back fails, in which case the error is still reported.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+	if (as == NULL) return EFAULT;
+
+	struct region *reg = as_findregion(as, addr);
+	if (reg == NULL || reg->base != addr || !reg->mapped) {
+		return EINVAL;
+	}
+
+	int result = 0;
+	if (reg->vnode != NULL && reg->write) {
+		result = vm_writeback(as, reg);
+	}
+	vm_freerange(as, reg->base, reg->base + reg->size);
+
+	as_delregion(as, reg);
+	if (reg->vnode != NULL) {
+		VOP_DECREF(reg->vnode);
+	}
+	kmem_cache_free(region_cache, reg);
+	return result;
+}
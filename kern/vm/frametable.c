@@ -1,24 +1,151 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <membar.h>
+#include <current.h>
 #include <thread.h>
+#include <wchan.h>
+#include <proc.h>
 #include <addrspace.h>
 #include <vm.h>
 
 // frame table entry states
 #define FRAME_FREE       0
 #define FRAME_USED       1
+#define FRAME_CACHED     2	// free, but held in a cpu's frame cache
 #define FRAME_LOCKED    -1
 
+// frames that user pages can't take, so kmalloc still works when memory is full
+#define FT_RESERVE       8
+
+// largest block the buddy allocator handles is 2^FT_MAX_ORDER frames
+#define FT_MAX_ORDER     10
+
+// end of a free list
+#define FT_NIL           0xffffffff
+
+// frames moved between a cpu's frame cache and the free lists at once
+#define FT_BATCH         (CPU_FRAMES / 2)
+
+// number of pre-zeroed frames kept ready for page faults
+#define ZP_SIZE          32
+
 struct ft_entry {
 	int state;
+	unsigned order;		// free block size as a power of two, set on the first frame
+	unsigned npages;	// length of an allocated extent, set on the first frame
+	unsigned next;		// free list links, only used while the block is free
+	unsigned prev;
+	unsigned refcount;	// number of page table entries sharing the frame
+	uint32_t pid;		// address space owning the page, 0 if unknown
+	vaddr_t page;		// virtual address the page is mapped at
+	unsigned loaded;	// when the current owner got the frame, for fifo
+	bool referenced;	// page has been used since the clock hand passed
+	bool dirty;		// page has been written since it was last on disk
+	bool prefetched;	// put in the TLB by fault-around and not missed on since
+};
+
+/*
+ * Page replacement policy. victim() returns the index of the frame to
+ * evict next, or num_frames if no frame can be evicted. It is called
+ * with stealmem_lock held.
+ */
+struct ft_policy {
+	const char *name;
+	unsigned int (*victim)(void);
+};
+
+static unsigned int fifo_victim(void);
+static unsigned int clock_victim(void);
+static unsigned int eclock_victim(void);
+
+static const struct ft_policy policies[] = {
+	{ "fifo",	fifo_victim },
+	{ "clock",	clock_victim },
+	{ "eclock",	eclock_victim },
 };
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 static struct ft_entry *f_table = NULL;
 static unsigned int num_frames;
-static unsigned int free_index;
+static unsigned int num_free;
+static unsigned int free_lists[FT_MAX_ORDER + 1];
+static unsigned int clock_hand;
+static unsigned int load_count;
+static unsigned int prefetch_count;	// TLB entries loaded by fault-around
+static unsigned int prefetch_missed;	// of those, pages that missed anyway
+static const struct ft_policy *policy = &policies[1];
+
+/*
+ * Pages whose reference bits a policy cleared while choosing a victim,
+ * still to be shot down from the TLBs by ft_victim(). Only ft_victim()
+ * uses these, and its caller holds evict_lock, so one at a time.
+ */
+#define FT_CLEARED       8
+
+static struct {
+	uint32_t pid;
+	vaddr_t page;
+} ft_cleared[FT_CLEARED];
+static unsigned int ft_ncleared;	// may be more than FT_CLEARED
+
+/*
+ * Pool of frames zeroed in the background by zero_thread(), protected
+ * by zero_lock. The thread sleeps on zero_wchan while the pool is full.
+ */
+static struct spinlock zero_lock = SPINLOCK_INITIALIZER;
+static struct wchan *zero_wchan;
+static unsigned int zero_pool[ZP_SIZE];
+static unsigned int zero_count;
+static unsigned int zero_hits;
+static unsigned int zero_misses;
+
+static void zero_thread(void *data1, unsigned long data2);
+static bool ft_mappable(unsigned int i, uint32_t pid, vaddr_t page, bool *dirty);
+static void ft_missed(unsigned int i);
+
+// adds a free block to the list for its order
+static
+void
+ft_push(unsigned int i, unsigned int order)
+{
+	f_table[i].order = order;
+	f_table[i].prev = FT_NIL;
+	f_table[i].next = free_lists[order];
+	if (free_lists[order] != FT_NIL) {
+		f_table[free_lists[order]].prev = i;
+	}
+	free_lists[order] = i;
+}
+
+// takes a free block off the list for its order
+static
+void
+ft_unlink(unsigned int i)
+{
+	unsigned int order = f_table[i].order;
+
+	if (f_table[i].prev == FT_NIL) {
+		free_lists[order] = f_table[i].next;
+	} else {
+		f_table[f_table[i].prev].next = f_table[i].next;
+	}
+	if (f_table[i].next != FT_NIL) {
+		f_table[f_table[i].next].prev = f_table[i].prev;
+	}
+}
+
+// whether frame i starts a free block of the given order
+static
+bool
+ft_isfreeblock(unsigned int i, unsigned int order)
+{
+	return i < num_frames && f_table[i].state == FRAME_FREE &&
+		f_table[i].order == order;
+}
 
 /* Initialization function */
 void ft_bootstrap(void)
@@ -26,7 +153,12 @@ void ft_bootstrap(void)
 	num_frames = ram_getsize() / PAGE_SIZE;
 	f_table = kmalloc(sizeof(struct ft_entry) * (num_frames));
 	unsigned int first_index = ram_getfirstfree() / PAGE_SIZE;
-	free_index = first_index;
+	clock_hand = first_index;
+	num_free = num_frames - first_index;
+
+	for (unsigned int i = 0; i <= FT_MAX_ORDER; i++) {
+		free_lists[i] = FT_NIL;
+	}
 
 	for (unsigned int i = 0; i < num_frames; i++) {
 		if (i < first_index) {
@@ -36,9 +168,304 @@ void ft_bootstrap(void)
 			// mark frames as free
 			f_table[i].state = FRAME_FREE;
 		}
+		f_table[i].order = 0;
+		f_table[i].npages = 0;
+		f_table[i].next = FT_NIL;
+		f_table[i].prev = FT_NIL;
+		f_table[i].refcount = 0;
+		f_table[i].pid = 0;
+		f_table[i].page = 0;
+		f_table[i].loaded = 0;
+		f_table[i].referenced = false;
+		f_table[i].dirty = false;
+		f_table[i].prefetched = false;
+	}
+
+	// hand out the free frames as the largest aligned blocks that fit
+	unsigned int i = first_index;
+	while (i < num_frames) {
+		unsigned int order = 0;
+		while (order < FT_MAX_ORDER && i % (2U << order) == 0 &&
+				i + (2U << order) <= num_frames) {
+			order++;
+		}
+		ft_push(i, order);
+		i += 1U << order;
+	}
+
+	zero_wchan = wchan_create("zero_wchan");
+	if (zero_wchan == NULL) {
+		panic("frametable.c: out of memory in bootstrap\n");
+	}
+	if (thread_fork("zero_thread", NULL, zero_thread, NULL, 0)) {
+		panic("frametable.c: can't start zero_thread\n");
+	}
+}
+
+// takes a free block of 2^order frames off the free lists, splitting a
+// larger one if needed. Returns FT_NIL if there is none. Called with
+// stealmem_lock held.
+static
+unsigned int
+ft_take(unsigned int order)
+{
+	// find the smallest block that is big enough
+	unsigned int found = order;
+	while (found <= FT_MAX_ORDER && free_lists[found] == FT_NIL) {
+		found++;
+	}
+	if (found > FT_MAX_ORDER) {
+		// memory is too fragmented
+		return FT_NIL;
+	}
+
+	unsigned int i = free_lists[found];
+	ft_unlink(i);
+	// split it in halves, putting the upper halves back on the free lists
+	while (found > order) {
+		found--;
+		ft_push(i + (1U << found), found);
+	}
+	f_table[i].order = order;
+	num_free -= 1U << order;
+	return i;
+}
+
+// puts a block of 2^order frames back on the free lists, merging it with
+// the neighbouring block for as long as that is free too. Called with
+// stealmem_lock held.
+static
+void
+ft_release(unsigned int i, unsigned int order)
+{
+	for (unsigned int j = i; j < i + (1U << order); j++) {
+		f_table[j].state = FRAME_FREE;
+		f_table[j].pid = 0;
+		f_table[j].page = 0;
+	}
+	num_free += 1U << order;
+
+	while (order < FT_MAX_ORDER && ft_isfreeblock(i ^ (1U << order), order)) {
+		ft_unlink(i ^ (1U << order));
+		i &= ~(1U << order);
+		order++;
+	}
+	ft_push(i, order);
+}
+
+// puts npages frames starting at i back on the free lists, as the
+// largest aligned blocks that fit. Called with stealmem_lock held.
+static
+void
+ft_releaserange(unsigned int i, unsigned int npages)
+{
+	unsigned int end = i + npages;
+
+	while (i < end) {
+		unsigned int order = 0;
+		while (order < FT_MAX_ORDER && i % (2U << order) == 0 &&
+				i + (2U << order) <= end) {
+			order++;
+		}
+		ft_release(i, order);
+		i += 1U << order;
+	}
+}
+
+// marks a block as allocated and zeroes it, unless that's already done
+static
+vaddr_t
+ft_claim(unsigned int i, unsigned int npages, bool zeroed)
+{
+	for (unsigned int j = i; j < i + npages; j++) {
+		f_table[j].refcount = 0;
+		f_table[j].npages = 0;
+		f_table[j].pid = 0;
+		f_table[j].page = 0;
+		f_table[j].referenced = false;
+		f_table[j].dirty = false;
+		f_table[j].prefetched = false;
+	}
+	f_table[i].refcount = 1;
+	f_table[i].npages = npages;
+	// the replacement policies read the state without owning the frame
+	membar_store_store();
+	for (unsigned int j = i; j < i + npages; j++) {
+		f_table[j].state = FRAME_USED;
+	}
+
+	if (!zeroed) {
+		bzero((void *)PADDR_TO_KVADDR(i * PAGE_SIZE), npages * PAGE_SIZE);
+	}
+	return PADDR_TO_KVADDR(i * PAGE_SIZE);
+}
+
+/*
+ * Takes npages contiguous frames, as long as more than reserve frames
+ * are free. The buddy allocator only has blocks of 2^order frames, so
+ * this takes the smallest block that fits and gives the frames past
+ * the end back, which keeps an extent of, say, 5 frames from holding 8.
+ * The extent starts on a 2^order boundary, so a whole block stays aligned.
+ */
+static
+vaddr_t
+ft_alloc(unsigned int npages, unsigned int reserve)
+{
+	unsigned int order = 0;
+	unsigned int i;
+
+	while ((1U << order) < npages) {
+		if (order == FT_MAX_ORDER) {
+			// bigger than any block
+			return 0;
+		}
+		order++;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	if (num_free < npages || num_free - npages < reserve) {
+		// no free memory
+		spinlock_release(&stealmem_lock);
+		return 0;
+	}
+
+	i = ft_take(order);
+	if (i == FT_NIL) {
+		spinlock_release(&stealmem_lock);
+		return 0;
+	}
+	// stop the frames looking free before the lock is dropped, or
+	// before the tail is released, so it can't merge with them
+	for (unsigned int j = i; j < i + (1U << order); j++) {
+		f_table[j].state = FRAME_CACHED;
+	}
+	ft_releaserange(i + npages, (1U << order) - npages);
+	spinlock_release(&stealmem_lock);
+
+	return ft_claim(i, npages, false);
+}
+
+// takes a single frame from the pre-zeroed pool, or returns FT_NIL
+static
+unsigned int
+zero_take(void)
+{
+	unsigned int i = FT_NIL;
+
+	spinlock_acquire(&zero_lock);
+	if (zero_count > 0) {
+		i = zero_pool[--zero_count];
+		zero_hits++;
+	} else {
+		zero_misses++;
+	}
+	if (zero_count < ZP_SIZE / 2) {
+		// running low, get the thread to top it up
+		wchan_wakeone(zero_wchan, &zero_lock);
+	}
+	spinlock_release(&zero_lock);
+	return i;
+}
+
+/*
+ * Keeps the pre-zeroed pool topped up, one frame at a time and yielding
+ * in between, so that the bzero happens here instead of in vm_fault().
+ * Frames are only taken while there is plenty of free memory.
+ */
+static
+void
+zero_thread(void *data1, unsigned long data2)
+{
+	unsigned int i;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&zero_lock);
+		while (zero_count == ZP_SIZE) {
+			wchan_sleep(zero_wchan, &zero_lock);
+		}
+		spinlock_release(&zero_lock);
+
+		spinlock_acquire(&stealmem_lock);
+		i = FT_NIL;
+		if (num_free > 2 * FT_RESERVE) {
+			i = ft_take(0);
+		}
+		if (i != FT_NIL) {
+			f_table[i].state = FRAME_CACHED;
+		}
+		spinlock_release(&stealmem_lock);
+
+		if (i == FT_NIL) {
+			// memory is tight, wait for the next allocation
+			spinlock_acquire(&zero_lock);
+			wchan_sleep(zero_wchan, &zero_lock);
+			spinlock_release(&zero_lock);
+			continue;
+		}
+
+		bzero((void *)PADDR_TO_KVADDR(i * PAGE_SIZE), PAGE_SIZE);
+
+		spinlock_acquire(&zero_lock);
+		if (zero_count < ZP_SIZE) {
+			zero_pool[zero_count++] = i;
+			i = FT_NIL;
+		}
+		spinlock_release(&zero_lock);
+		if (i != FT_NIL) {
+			// filled up while we were zeroing
+			spinlock_acquire(&stealmem_lock);
+			ft_release(i, 0);
+			spinlock_release(&stealmem_lock);
+		}
+
+		thread_yield();
 	}
 }
 
+// takes a single frame, using the pre-zeroed pool or this cpu's frame
+// cache when possible
+static
+vaddr_t
+ft_alloc1(unsigned int reserve)
+{
+	struct cpu *c;
+	unsigned int i;
+	int spl;
+
+	i = zero_take();
+	if (i != FT_NIL) {
+		return ft_claim(i, 1, true);
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_numframes == 0) {
+		// refill the cache with a batch of frames from the free lists
+		spinlock_acquire(&stealmem_lock);
+		while (c->c_numframes < FT_BATCH && num_free > reserve) {
+			i = ft_take(0);
+			if (i == FT_NIL) {
+				break;
+			}
+			f_table[i].state = FRAME_CACHED;
+			c->c_frames[c->c_numframes++] = i;
+		}
+		spinlock_release(&stealmem_lock);
+	}
+	if (c->c_numframes == 0) {
+		// no free memory
+		splx(spl);
+		return 0;
+	}
+	i = c->c_frames[--c->c_numframes];
+	splx(spl);
+
+	return ft_claim(i, 1, false);
+}
+
 /* Note that this function returns a VIRTUAL address, not a physical
  * address
  * WARNING: this function gets called very early, before
@@ -61,35 +488,39 @@ vaddr_t alloc_kpages(unsigned int npages)
 		return PADDR_TO_KVADDR(addr);
 	}
 
-	if (npages != 1) {
-		// allocator only works for 1 page alloc
-		return 0;
+	if (npages <= 1) {
+		return ft_alloc1(0);
 	}
+	return ft_alloc(npages, 0);
+}
 
-	spinlock_acquire(&stealmem_lock);
-	if (free_index == num_frames) {
-		// no free memory
-		spinlock_release(&stealmem_lock);
+// allocates a frame for a user page, failing early so the caller can evict
+vaddr_t alloc_upage(void)
+{
+	return ft_alloc1(FT_RESERVE);
+}
+
+/*
+ * Allocates 2^order physically contiguous, aligned frames for a run of
+ * user pages. Unlike a kernel block, each frame is then a page of its
+ * own with its own reference count, so the pages can be shared, evicted
+ * and freed one by one.
+ */
+vaddr_t alloc_urun(unsigned int order)
+{
+	vaddr_t run = ft_alloc(1U << order, FT_RESERVE);
+	if (run == 0) {
 		return 0;
 	}
 
-	addr = free_index * PAGE_SIZE;
-	// set memory as allocated
-	f_table[free_index].state = FRAME_USED;
-
-	unsigned int i = free_index;
-	free_index = num_frames;
-	for (; i < num_frames; i++) {
-		if (f_table[i].state == FRAME_FREE) {
-			// update free_index to the next free frame
-			free_index = i;
-			break;
-		}
+	unsigned int i = KVADDR_TO_PADDR(run) / PAGE_SIZE;
+	spinlock_acquire(&stealmem_lock);
+	for (unsigned int j = i; j < i + (1U << order); j++) {
+		f_table[j].npages = 1;
+		f_table[j].refcount = 1;
 	}
 	spinlock_release(&stealmem_lock);
-
-	bzero((void *)PADDR_TO_KVADDR(addr), PAGE_SIZE);
-	return PADDR_TO_KVADDR(addr);
+	return run;
 }
 
 void free_kpages(vaddr_t addr)
@@ -104,12 +535,395 @@ void free_kpages(vaddr_t addr)
 		return;
 	}
 
-	f_table[addr_index].state = FRAME_FREE;
-	if (addr_index < free_index) {
-		// freed frame is before current first free frame or there
-		// were no free frames
-		free_index = addr_index;
+	KASSERT(f_table[addr_index].refcount > 0);
+	f_table[addr_index].refcount--;
+	if (f_table[addr_index].refcount > 0) {
+		// frame is still shared with another page table entry. The
+		// owner may be the address space letting go of it, so forget
+		// it until the remaining user faults on the page again.
+		f_table[addr_index].pid = 0;
+		f_table[addr_index].page = 0;
+		spinlock_release(&stealmem_lock);
+		return;
+	}
+
+	if (f_table[addr_index].npages > 1) {
+		// a multi-page extent goes straight back to the free lists
+		ft_releaserange(addr_index, f_table[addr_index].npages);
+		spinlock_release(&stealmem_lock);
+		return;
+	}
+	f_table[addr_index].state = FRAME_CACHED;
+	f_table[addr_index].pid = 0;
+	f_table[addr_index].page = 0;
+	spinlock_release(&stealmem_lock);
+
+	// keep single frames in this cpu's cache
+	int spl = splhigh();
+	struct cpu *c = curcpu->c_self;
+	if (c->c_numframes == CPU_FRAMES) {
+		// cache is full, give a batch back to the free lists
+		spinlock_acquire(&stealmem_lock);
+		while (c->c_numframes > CPU_FRAMES - FT_BATCH) {
+			ft_release(c->c_frames[--c->c_numframes], 0);
+		}
+		spinlock_release(&stealmem_lock);
+	}
+	c->c_frames[c->c_numframes++] = addr_index;
+	splx(spl);
+}
+
+// adds a reference to a frame that is being shared copy-on-write
+void ft_incref(vaddr_t addr)
+{
+	unsigned int addr_index = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(f_table[addr_index].state == FRAME_USED);
+	f_table[addr_index].refcount++;
+	spinlock_release(&stealmem_lock);
+}
+
+// returns the number of references to a frame
+unsigned int ft_refcount(vaddr_t addr)
+{
+	unsigned int addr_index = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	unsigned int refcount;
+
+	spinlock_acquire(&stealmem_lock);
+	refcount = f_table[addr_index].refcount;
+	spinlock_release(&stealmem_lock);
+	return refcount;
+}
+
+// records which page a frame holds so it can be found again for eviction
+void ft_setowner(vaddr_t addr, uint32_t pid, vaddr_t page)
+{
+	unsigned int addr_index = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(f_table[addr_index].state == FRAME_USED);
+	if (f_table[addr_index].pid != pid || f_table[addr_index].page != page) {
+		f_table[addr_index].pid = pid;
+		f_table[addr_index].page = page;
+		f_table[addr_index].loaded = load_count++;
+	}
+	spinlock_release(&stealmem_lock);
+}
+
+// notes that a frame is being loaded into the TLB, returns whether it's dirty
+bool ft_touch(vaddr_t addr, bool write)
+{
+	unsigned int addr_index = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	bool dirty;
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(f_table[addr_index].state == FRAME_USED);
+	ft_missed(addr_index);
+	f_table[addr_index].referenced = true;
+	if (write) {
+		f_table[addr_index].dirty = true;
+	}
+	dirty = f_table[addr_index].dirty;
+	spinlock_release(&stealmem_lock);
+	return dirty;
+}
+
+// whether a frame has been written since it was last on disk
+bool ft_dirty(vaddr_t addr)
+{
+	unsigned int addr_index = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	bool dirty;
+
+	spinlock_acquire(&stealmem_lock);
+	dirty = f_table[addr_index].dirty;
+	spinlock_release(&stealmem_lock);
+	return dirty;
+}
+
+// checks that a frame still holds the given page, or is shared and so
+// can't be evicted, and if so marks it referenced, for vm_tlbrefill()
+bool ft_refill(vaddr_t addr, uint32_t pid, vaddr_t page, bool *dirty)
+{
+	unsigned int addr_index = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	bool owned;
+
+	spinlock_acquire(&stealmem_lock);
+	owned = ft_mappable(addr_index, pid, page, dirty);
+	if (owned) {
+		ft_missed(addr_index);
+		f_table[addr_index].referenced = true;
 	}
 	spinlock_release(&stealmem_lock);
+	return owned;
 }
 
+// like ft_refill(), but for a page loaded into the TLB before it's used,
+// so the reference bit is left alone
+bool ft_prefetch(vaddr_t addr, uint32_t pid, vaddr_t page, bool *dirty)
+{
+	unsigned int addr_index = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	bool owned;
+
+	spinlock_acquire(&stealmem_lock);
+	owned = ft_mappable(addr_index, pid, page, dirty);
+	if (owned) {
+		f_table[addr_index].prefetched = true;
+		prefetch_count++;
+	}
+	spinlock_release(&stealmem_lock);
+	return owned;
+}
+
+// hands back the fault-around counters
+void ft_prefetchstats(unsigned int *count, unsigned int *missed)
+{
+	spinlock_acquire(&stealmem_lock);
+	*count = prefetch_count;
+	*missed = prefetch_missed;
+	spinlock_release(&stealmem_lock);
+}
+
+// picks an unshared user frame to page out using the current policy
+vaddr_t ft_victim(uint32_t *pid, vaddr_t *page)
+{
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(ft_ncleared == 0);
+	unsigned int i = policy->victim();
+	unsigned int ncleared = ft_ncleared;
+	ft_ncleared = 0;
+	if (i < num_frames) {
+		*pid = f_table[i].pid;
+		*page = f_table[i].page;
+	}
+	spinlock_release(&stealmem_lock);
+
+	/*
+	 * Drop the pages whose reference bits were cleared from every TLB,
+	 * so the next use sets the bit again. The caller holds the lock
+	 * as_destroy() takes, so their address spaces are still there.
+	 */
+	if (ncleared > FT_CLEARED) {
+		vm_tlbinvalidate(NULL, 0);
+	} else {
+		for (unsigned int n = 0; n < ncleared; n++) {
+			vm_tlbinvalidate((struct addrspace *) ft_cleared[n].pid,
+				ft_cleared[n].page);
+		}
+	}
+
+	if (i == num_frames) {
+		// nothing can be evicted
+		return 0;
+	}
+	return PADDR_TO_KVADDR(i * PAGE_SIZE);
+}
+
+// selects the replacement policy by name
+int ft_setpolicy(const char *name)
+{
+	for (unsigned int i = 0; i < ARRAYCOUNT(policies); i++) {
+		if (!strcmp(policies[i].name, name)) {
+			spinlock_acquire(&stealmem_lock);
+			policy = &policies[i];
+			spinlock_release(&stealmem_lock);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+// lists the replacement policies, marking the one in use
+void ft_printpolicies(void)
+{
+	for (unsigned int i = 0; i < ARRAYCOUNT(policies); i++) {
+		kprintf("%s%s\n", policies[i].name,
+			&policies[i] == policy ? " (current)" : "");
+	}
+}
+
+// counts the frames in each state and prints them
+void ft_printstats(void)
+{
+	unsigned int nfree = 0, cached = 0, used = 0, shared = 0, owned = 0;
+
+	spinlock_acquire(&stealmem_lock);
+	for (unsigned int i = 0; i < num_frames; i++) {
+		switch (f_table[i].state) {
+			case FRAME_FREE:
+			nfree++;
+			break;
+			case FRAME_CACHED:
+			cached++;
+			break;
+			case FRAME_USED:
+			used++;
+			if (f_table[i].refcount > 1) {
+				shared++;
+			} else if (f_table[i].pid != 0) {
+				owned++;
+			}
+			break;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+
+	kprintf("Frames: %u total, %u free, %u in cpu caches or the zero "
+		"pool, %u used\n", num_frames, nfree, cached, used);
+	kprintf("Used frames: %u user pages that can be evicted, %u shared\n",
+		owned, shared);
+}
+
+void ft_printzerostats(void)
+{
+	unsigned int count, hits, misses;
+
+	spinlock_acquire(&zero_lock);
+	count = zero_count;
+	hits = zero_hits;
+	misses = zero_misses;
+	spinlock_release(&zero_lock);
+
+	kprintf("Zeroed frames ready: %u of %u\n", count, ZP_SIZE);
+	kprintf("Allocations from the pool: %u\n", hits);
+	kprintf("Allocations zeroed inline: %u\n", misses);
+}
+
+// whether a frame can be mapped without the page table lock: it holds the
+// given page of one address space only, or it's shared, in which case it
+// is never evicted and must stay read-only. Shared frames don't record
+// their owners, so callers must check afterwards that the page table
+// entry they read still names this frame.
+static
+bool
+ft_mappable(unsigned int i, uint32_t pid, vaddr_t page, bool *dirty)
+{
+	if (f_table[i].state != FRAME_USED) {
+		return false;
+	}
+	if (f_table[i].refcount > 1) {
+		*dirty = false;
+		return true;
+	}
+	*dirty = f_table[i].dirty;
+	return f_table[i].pid == pid && f_table[i].page == page;
+}
+
+// a TLB miss on a prefetched page means the prefetch didn't help
+static
+void
+ft_missed(unsigned int i)
+{
+	if (f_table[i].prefetched) {
+		f_table[i].prefetched = false;
+		prefetch_missed++;
+	}
+}
+
+// frames holding a page of one process only, which can be written out
+static
+bool
+ft_evictable(unsigned int i)
+{
+	return f_table[i].state == FRAME_USED && f_table[i].refcount == 1 &&
+		f_table[i].pid != 0;
+}
+
+/*
+ * MIPS has no hardware reference bit, so clearing it also has to drop
+ * the page from the TLB of every cpu. That can't be done while holding
+ * stealmem_lock, so the page is noted here and ft_victim() does it once
+ * the lock is released; past FT_CLEARED pages it flushes every TLB
+ * instead.
+ */
+static
+void
+ft_clearref(unsigned int i)
+{
+	f_table[i].referenced = false;
+	if (ft_ncleared < FT_CLEARED) {
+		ft_cleared[ft_ncleared].pid = f_table[i].pid;
+		ft_cleared[ft_ncleared].page = f_table[i].page;
+	}
+	ft_ncleared++;
+}
+
+// evicts the page that has been in memory the longest
+static
+unsigned int
+fifo_victim(void)
+{
+	unsigned int victim = num_frames;
+
+	for (unsigned int i = 0; i < num_frames; i++) {
+		if (!ft_evictable(i)) {
+			continue;
+		}
+		// compare ages rather than counts so the counter can wrap
+		if (victim == num_frames ||
+				load_count - f_table[i].loaded >
+				load_count - f_table[victim].loaded) {
+			victim = i;
+		}
+	}
+	return victim;
+}
+
+// second chance: pass over referenced pages once, clearing the bit
+static
+unsigned int
+clock_victim(void)
+{
+	// two sweeps, the first may only clear reference bits
+	for (unsigned int n = 0; n < 2 * num_frames; n++) {
+		unsigned int i = clock_hand;
+		clock_hand = (clock_hand + 1) % num_frames;
+		if (!ft_evictable(i)) {
+			continue;
+		}
+		if (f_table[i].referenced) {
+			ft_clearref(i);
+			continue;
+		}
+		return i;
+	}
+	return num_frames;
+}
+
+/*
+ * Enhanced clock: prefer pages that are neither referenced nor dirty,
+ * then unreferenced dirty pages, clearing reference bits on the way.
+ * After two rounds every reference bit is clear so something is found.
+ */
+static
+unsigned int
+eclock_victim(void)
+{
+	for (unsigned int round = 0; round < 2; round++) {
+		// look for a clean unreferenced page without changing anything
+		for (unsigned int n = 0; n < num_frames; n++) {
+			unsigned int i = (clock_hand + n) % num_frames;
+			if (ft_evictable(i) && !f_table[i].referenced &&
+					!f_table[i].dirty) {
+				clock_hand = (i + 1) % num_frames;
+				return i;
+			}
+		}
+		// settle for a dirty one, giving referenced pages a second chance
+		for (unsigned int n = 0; n < num_frames; n++) {
+			unsigned int i = clock_hand;
+			clock_hand = (clock_hand + 1) % num_frames;
+			if (!ft_evictable(i)) {
+				continue;
+			}
+			if (f_table[i].referenced) {
+				ft_clearref(i);
+				continue;
+			}
+			if (f_table[i].dirty) {
+				return i;
+			}
+		}
+	}
+	return num_frames;
+}
@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -101,6 +105,9 @@ fill_deadbeef(void *vptr, size_t len)
  *
  * LABELS records the allocation site and a generation number for each
  * allocation and is useful for tracking down memory leaks.
+ * Without rebuilding, the sampling heap profiler further down counts
+ * allocations per size class and per call site; see khprof and
+ * khsites in the menu.
  *
  * On top of these one can enable the following:
  *
@@ -149,6 +156,7 @@ struct pageref {
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
+	uint16_t nsampled;	/* blocks in kprof_live[], see below */
 };
 
 #define INVALID_OFFSET   (0xffff)
@@ -160,10 +168,10 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and their pagerefs. Most calls don't
+ * take it, because each cpu caches free blocks of each size (see
+ * subpage_getblock below) and kfree finds a block's page through
+ * kheap_pagerefs[] without it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -171,57 +179,86 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 ////////////////////////////////////////
 
 /*
- * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * Pagerefs are allocated a page at a time and never freed. Unused
+ * ones are kept on a free list linked through next_samesize. A pageref
+ * is 20 bytes, so each page of pagerefs holds 204, which can manage up
+ * to 204 * 4K = 816K of kernel heap, and more pages are added as the
+ * heap grows. (nsampled would fit in 16 bytes only by sharing a word
+ * with nfree or the block type, which are updated under a different
+ * lock.)
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * There can never be more heap pages than frames of RAM, so that is
+ * the limit on pagerefs. kheap_pagerefs[] has an entry for each frame
+ * pointing back to the pageref of the heap page in it, or NULL if the
+ * frame isn't a subpage heap page, so kfree can find a block's pageref
+ * without searching. Both are set up by kheap_init the first time a
+ * pageref is needed, which is early in boot while ram_getsize() still
+ * works; the map costs one word per frame (16K for 16M of RAM).
  */
 
 #define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
+static struct pageref *freepagerefs;	/* unused pagerefs */
+static unsigned numpagerefs;		/* pagerefs allocated, used or not */
+static unsigned kheap_nframes;		/* frames of RAM */
+static struct pageref **kheap_pagerefs;	/* pageref for each frame */
 
 /*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
+ * The first frame of a multi-page allocation has its length in pages
+ * in its kheap_pagerefs[] entry instead, tagged by setting the low
+ * bit, which a pageref pointer never has.
  */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
+#define KH_ISLARGE(pr)     (((vaddr_t)(pr) & 1) != 0)
+#define KH_MKLARGE(n)      ((struct pageref *)(((vaddr_t)(n) << 1) | 1))
+#define KH_LARGEPAGES(pr)  ((vaddr_t)(pr) >> 1)
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * Size the frame map from the amount of RAM and allocate it.
  */
+static
+void
+kheap_init(void)
+{
+	unsigned nframes, npages, i;
+	vaddr_t va;
+
+	KASSERT(kheap_pagerefs == NULL);
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+	nframes = ram_getsize() / PAGE_SIZE;
+	KASSERT(nframes > 0);
+	npages = DIVROUNDUP(nframes * sizeof(struct pageref *), PAGE_SIZE);
+
+	/* As in allocpagerefpage, call alloc_kpages without the lock. */
+	spinlock_release(&kmalloc_spinlock);
+	va = alloc_kpages(npages);
+	spinlock_acquire(&kmalloc_spinlock);
+	if (va == 0) {
+		panic("kmalloc: Couldn't allocate the heap frame map\n");
+	}
+	KASSERT(kheap_pagerefs == NULL);
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+	kheap_pagerefs = (struct pageref **)va;
+	for (i=0; i<nframes; i++) {
+		kheap_pagerefs[i] = NULL;
+	}
+	kheap_nframes = nframes;
+}
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a page of pagerefs and put them on the free list.
  */
 static
 void
-allocpagerefpage(struct kheap_root *root)
+allocpagerefpage(void)
 {
+	struct pageref *refs;
 	vaddr_t va;
+	unsigned i;
 
-	KASSERT(root->page == NULL);
+	if (numpagerefs >= kheap_nframes) {
+		/* one for every frame already */
+		return;
+	}
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
@@ -237,17 +274,20 @@ allocpagerefpage(struct kheap_root *root)
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
+	if (freepagerefs != NULL) {
+		/* Oops, somebody else allocated some. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(va);
 		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
 		return;
 	}
 
-	root->page = (struct pagerefpage *)va;
+	refs = (struct pageref *)va;
+	for (i=0; i<NPAGEREFS_PER_PAGE; i++) {
+		refs[i].next_samesize = freepagerefs;
+		freepagerefs = &refs[i];
+	}
+	numpagerefs += NPAGEREFS_PER_PAGE;
 }
 
 /*
@@ -257,44 +297,24 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	struct pageref *pr;
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (kheap_pagerefs == NULL) {
+		kheap_init();
+	}
+	if (freepagerefs == NULL) {
+		allocpagerefpage();
+	}
+	if (freepagerefs == NULL) {
+		/* ran out */
+		return NULL;
 	}
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	freepagerefs = pr->next_samesize;
+	return pr;
 }
 
 /*
@@ -304,36 +324,10 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
-	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
 }
 
 ////////////////////////////////////////
@@ -588,14 +582,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(sc < numpagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < numpagerefs);
 		ac++;
 	}
 
@@ -867,49 +861,20 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take a free block off one of the pages of blocks of type BLKTYPE.
+ * Returns NULL if none of them has a free block.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_takeblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -918,9 +883,6 @@ subpage_kmalloc(size_t sz
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
@@ -940,35 +902,37 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
 			return retptr;
 		}
 	}
+	return NULL;
+}
 
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
+/*
+ * Get a fresh page and divide it into free blocks of type BLKTYPE.
+ * Returns false if out of memory. Like allocpagerefpage, this drops
+ * kmalloc_spinlock while calling alloc_kpages.
+ */
+static
+bool
+subpage_newpage(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+
+	volatile int i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
@@ -983,11 +947,13 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nsampled = 0;
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1013,101 +979,75 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	KASSERT(KVADDR_TO_PADDR(prpage) / PAGE_SIZE < kheap_nframes);
+	kheap_pagerefs[KVADDR_TO_PADDR(prpage) / PAGE_SIZE] = pr;
+
+	return true;
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Find the pageref for the page a block is on, or NULL if it isn't on
+ * any heap page we recognize.
+ *
+ * This doesn't need kmalloc_spinlock if ptraddr is a block that is
+ * allocated (or in a cpu's cache), because then its page can't be
+ * freed and its kheap_pagerefs[] entry can't change. Likewise a page
+ * that belongs to a multi-page allocation has no entry and won't get
+ * one until it's freed.
  */
 static
-int
-subpage_kfree(void *ptr)
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	paddr_t frame;
+
+	if (kheap_pagerefs == NULL) {
+		return NULL;
+	}
+	frame = KVADDR_TO_PADDR(ptraddr) / PAGE_SIZE;
+	if (frame >= kheap_nframes) {
+		return NULL;
+	}
+	pr = kheap_pagerefs[frame];
+	if (KH_ISLARGE(pr)) {
+		/* first page of a multi-page allocation */
+		return NULL;
+	}
+	if (pr != NULL) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+	}
+	return pr;
+}
+
+/*
+ * Put a block back on the free list of its page. If that leaves the
+ * whole page free, the page is taken off the lists and returned for
+ * the caller to free_kpages once it has released kmalloc_spinlock;
+ * otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_putblock(vaddr_t ptraddr)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
-
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
+	pr = subpage_findpage(ptraddr);
+	KASSERT(pr != NULL);
+	checksubpage(pr);
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
-
-#ifdef GUARDS
-	blocksize = sizes[blktype];
-	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
-	checkguardband(ptraddr, smallerblocksize, blocksize);
-#endif
-
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
-
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
@@ -1140,85 +1080,758 @@ subpage_kfree(void *ptr)
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
+		KASSERT(pr->nsampled == 0);
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+		kheap_pagerefs[KVADDR_TO_PADDR(prpage) / PAGE_SIZE] = NULL;
+		return prpage;
 	}
-
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
-
 	return 0;
 }
 
-//
-////////////////////////////////////////////////////////////
+/*
+ * Per-cpu block caches.
+ *
+ * Each cpu keeps up to CPU_KBLOCKS free blocks of each size in its
+ * struct cpu. kmalloc and kfree of small blocks use these with
+ * interrupts off and only take kmalloc_spinlock to move KBATCH blocks
+ * at a time between a cpu's cache and the pages' free lists. Blocks in
+ * a cache still count as allocated as far as their pages are concerned,
+ * so kheap_printstats shows them as in use and their pages can't be
+ * freed until they drain back.
+ *
+ * The caches aren't used before curcpu is set up during boot.
+ */
+
+#if CPU_KSIZES != NSIZES
+#error "CPU_KSIZES in cpu.h doesn't match NSIZES"
+#endif
+
+#define KBATCH (CPU_KBLOCKS / 2)
 
 /*
- * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * Take a free block of type BLKTYPE, from this cpu's cache if it has
+ * one, refilling the cache with a batch from the free lists if not.
  */
+static
 void *
-kmalloc(size_t sz)
+subpage_getblock(unsigned blktype)
 {
-	size_t checksz;
-#ifdef LABELS
-	vaddr_t label;
-#endif
-
-#ifdef LABELS
-#ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
-#else
-#error "Don't know how to get return address with this compiler"
-#endif /* __GNUC__ */
-#endif /* LABELS */
+	struct cpu *c;
+	void *block;
+	int spl;
 
-	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
-
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
+	if (!CURCPU_EXISTS()) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		block = subpage_takeblock(blktype);
+		if (block == NULL && subpage_newpage(blktype)) {
+			block = subpage_takeblock(blktype);
 		}
-		KASSERT(address % PAGE_SIZE == 0);
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return block;
+	}
 
-		return (void *)address;
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_numkblocks[blktype] == 0) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		while (c->c_numkblocks[blktype] < KBATCH) {
+			block = subpage_takeblock(blktype);
+			if (block == NULL) {
+				if (c->c_numkblocks[blktype] > 0 ||
+				    !subpage_newpage(blktype)) {
+					break;
+				}
+				continue;
+			}
+			c->c_kblocks[blktype][c->c_numkblocks[blktype]++] = block;
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+	}
+	if (c->c_numkblocks[blktype] == 0) {
+		/* Out of memory. */
+		splx(spl);
+		return NULL;
 	}
+	block = c->c_kblocks[blktype][--c->c_numkblocks[blktype]];
+	splx(spl);
 
-#ifdef LABELS
-	return subpage_kmalloc(sz, label);
-#else
-	return subpage_kmalloc(sz);
-#endif
+	return block;
 }
 
 /*
- * Free a block previously returned from kmalloc.
+ * Give a block back, into this cpu's cache if there is room, sending
+ * a batch back to the free lists if not.
  */
+static
 void
-kfree(void *ptr)
+subpage_putcached(vaddr_t ptraddr, unsigned blktype)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	struct cpu *c;
+	vaddr_t prpage;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		spinlock_acquire(&kmalloc_spinlock);
+		prpage = subpage_putblock(ptraddr);
+		spinlock_release(&kmalloc_spinlock);
+		if (prpage != 0) {
+			free_kpages(prpage);
+		}
+		return;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	/* freeing twice in a row puts the same block on top of the cache */
+	KASSERT(c->c_numkblocks[blktype] == 0 ||
+		c->c_kblocks[blktype][c->c_numkblocks[blktype] - 1] !=
+		(void *)ptraddr);
+
+	if (c->c_numkblocks[blktype] == CPU_KBLOCKS) {
+		spinlock_acquire(&kmalloc_spinlock);
+		while (c->c_numkblocks[blktype] > CPU_KBLOCKS - KBATCH) {
+			prpage = subpage_putblock((vaddr_t)
+				c->c_kblocks[blktype][--c->c_numkblocks[blktype]]);
+			if (prpage != 0) {
+				/* Call free_kpages without kmalloc_spinlock. */
+				spinlock_release(&kmalloc_spinlock);
+				free_kpages(prpage);
+				spinlock_acquire(&kmalloc_spinlock);
+			}
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+	}
+	c->c_kblocks[blktype][c->c_numkblocks[blktype]++] = (void *)ptraddr;
+	splx(spl);
+}
+
+////////////////////////////////////////
+
+/*
+ * Heap profiler.
+ *
+ * Unlike LABELS this is always compiled in, and cheap enough to leave
+ * running:
+ *
+ *    - Each cpu counts allocations, frees and bytes requested for each
+ *      size class, with class NSIZES for multi-page allocations. Like
+ *      the VM counters these take no lock and can be slightly off if
+ *      a thread changes cpu partway through an update.
+ *
+ *    - One small allocation in kprof_period on each cpu is sampled:
+ *      its caller goes in kprof_sites[] and the block in kprof_live[]
+ *      until it's freed. Each sample stands for kprof_period
+ *      allocations, so scaling up gives an estimate of how much each
+ *      call site has allocated and still holds. Multi-page allocations
+ *      are rare and big, so every one is sampled.
+ *
+ * kfree only needs kprof_lock for blocks that were sampled. The
+ * pageref of each page counts the sampled blocks on it, so a block on
+ * a page with none is skipped without taking the lock.
+ */
+
+#define KPROF_PERIOD 64		/* default sampling period */
+#define KPROF_SITES  64		/* call sites tracked */
+#define KPROF_LIVE   512	/* sampled blocks tracked, a power of 2 */
+
+struct kprof_class {
+	unsigned kp_allocs;
+	unsigned kp_frees;
+	unsigned kp_bytes;		/* bytes requested by kp_allocs */
+};
+
+struct kprof_site {
+	vaddr_t ks_site;		/* return address in kmalloc's caller */
+	unsigned ks_samples;		/* allocations sampled */
+	unsigned ks_allocs;		/* allocations they stand for */
+	unsigned ks_bytes;		/* bytes those requested */
+	unsigned ks_live;		/* allocations not freed yet */
+	unsigned ks_livebytes;		/* bytes they requested */
+};
+
+struct kprof_block {
+	vaddr_t kb_ptr;			/* the block, or 0 if the slot is empty */
+	unsigned kb_site;		/* index in kprof_sites[] */
+	unsigned kb_size;		/* bytes requested */
+	unsigned kb_weight;		/* allocations this sample stands for */
+};
+
+static struct kprof_class kprof_classes[MAXCPUS][NSIZES + 1];
+static unsigned kprof_countdown[MAXCPUS];
+static unsigned kprof_period = KPROF_PERIOD;	/* 0 turns sampling off */
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static struct kprof_site kprof_sites[KPROF_SITES];
+static unsigned kprof_nsites;
+static struct kprof_block kprof_live[KPROF_LIVE]; /* open addressed */
+static unsigned kprof_nlive;
+static unsigned kprof_nlarge;		/* multi-page blocks in kprof_live */
+static unsigned kprof_dropped;		/* samples lost to full tables */
+
+/*
+ * Counters for the cpu we're on.
+ */
+static
+struct kprof_class *
+kprof_counters(unsigned class)
+{
+	unsigned cpu = CURCPU_EXISTS() ? curcpu->c_number : 0;
+
+	return &kprof_classes[cpu][class];
+}
+
+/*
+ * Home slot of a block in kprof_live[].
+ */
+static
+unsigned
+kprof_slot(vaddr_t ptr)
+{
+	return (ptr / SMALLEST_SUBPAGE_SIZE) & (KPROF_LIVE - 1);
+}
+
+/*
+ * Find a block's slot in kprof_live[], or KPROF_LIVE if it isn't there.
+ */
+static
+unsigned
+kprof_find(vaddr_t ptr)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kprof_lock));
+
+	for (i = kprof_slot(ptr); kprof_live[i].kb_ptr != 0;
+	     i = (i + 1) & (KPROF_LIVE - 1)) {
+		if (kprof_live[i].kb_ptr == ptr) {
+			return i;
+		}
+	}
+	return KPROF_LIVE;
+}
+
+/*
+ * Empty slot i of kprof_live[], moving back any later entries in the
+ * same run that would no longer be found past the gap.
+ */
+static
+void
+kprof_remove(unsigned i)
+{
+	unsigned j, home;
+
+	KASSERT(spinlock_do_i_hold(&kprof_lock));
+
+	kprof_live[i].kb_ptr = 0;
+	kprof_nlive--;
+	for (j = (i + 1) & (KPROF_LIVE - 1); kprof_live[j].kb_ptr != 0;
+	     j = (j + 1) & (KPROF_LIVE - 1)) {
+		home = kprof_slot(kprof_live[j].kb_ptr);
+		/* can the entry at j move to i? only if i is between home and j */
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && home <= i && home > j)) {
+			kprof_live[i] = kprof_live[j];
+			kprof_live[j].kb_ptr = 0;
+			i = j;
+		}
+	}
+}
+
+/*
+ * Record a sampled allocation.
+ */
+static
+void
+kprof_sample(vaddr_t ptr, size_t sz, unsigned class, vaddr_t site,
+	     unsigned weight)
+{
+	struct kprof_site *ks;
+	struct pageref *pr = NULL;
+	unsigned s, i;
+
+	if (class < NSIZES) {
+		/* our block, so its page can't change under us */
+		pr = subpage_findpage(ptr);
+		KASSERT(pr != NULL);
+	}
+
+	spinlock_acquire(&kprof_lock);
+
+	for (s = 0; s < kprof_nsites; s++) {
+		if (kprof_sites[s].ks_site == site) {
+			break;
+		}
+	}
+	if (s == kprof_nsites) {
+		if (kprof_nsites == KPROF_SITES ||
+		    kprof_nlive >= KPROF_LIVE * 3 / 4) {
+			kprof_dropped++;
+			spinlock_release(&kprof_lock);
+			return;
+		}
+		ks = &kprof_sites[kprof_nsites++];
+		bzero(ks, sizeof(*ks));
+		ks->ks_site = site;
+	}
+	ks = &kprof_sites[s];
+	ks->ks_samples++;
+	ks->ks_allocs += weight;
+	ks->ks_bytes += sz * weight;
+
+	/* keep the table no more than 3/4 full so runs stay short */
+	if (kprof_nlive >= KPROF_LIVE * 3 / 4) {
+		kprof_dropped++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	for (i = kprof_slot(ptr); kprof_live[i].kb_ptr != 0;
+	     i = (i + 1) & (KPROF_LIVE - 1)) {
+		KASSERT(kprof_live[i].kb_ptr != ptr);
+	}
+	kprof_live[i].kb_ptr = ptr;
+	kprof_live[i].kb_site = s;
+	kprof_live[i].kb_size = sz;
+	kprof_live[i].kb_weight = weight;
+	kprof_nlive++;
+	ks->ks_live += weight;
+	ks->ks_livebytes += sz * weight;
+
+	if (pr != NULL) {
+		pr->nsampled++;
+	}
+	else {
+		kprof_nlarge++;
+	}
+
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Count an allocation of SZ bytes in size class CLASS, and maybe
+ * sample it. PTR is what kmalloc returns.
+ */
+static
+void
+kprof_alloc(void *ptr, size_t sz, unsigned class, vaddr_t site)
+{
+	struct kprof_class *kp = kprof_counters(class);
+	unsigned *countdown;
+	unsigned period = kprof_period;
+
+	kp->kp_allocs++;
+	kp->kp_bytes += sz;
+
+	if (class == NSIZES) {
+		kprof_sample((vaddr_t)ptr, sz, class, site, 1);
+		return;
+	}
+	if (period == 0) {
+		return;
+	}
+	countdown = &kprof_countdown[CURCPU_EXISTS() ? curcpu->c_number : 0];
+	if (++*countdown < period) {
+		return;
+	}
+	*countdown = 0;
+	kprof_sample((vaddr_t)ptr, sz, class, site, period);
+}
+
+/*
+ * Count a free, and forget the block if it was sampled. PR is the
+ * pageref of its page, or NULL for a multi-page block. Must be called
+ * before the block can be handed out again.
+ */
+static
+void
+kprof_free(void *ptr, unsigned class, struct pageref *pr)
+{
+	struct kprof_site *ks;
+	unsigned i;
+
+	kprof_counters(class)->kp_frees++;
+
+	/* cheap check first; if ours was sampled this can't be zero */
+	if (pr != NULL ? pr->nsampled == 0 : kprof_nlarge == 0) {
+		return;
+	}
+
+	spinlock_acquire(&kprof_lock);
+	i = kprof_find((vaddr_t)ptr);
+	if (i < KPROF_LIVE) {
+		ks = &kprof_sites[kprof_live[i].kb_site];
+		ks->ks_live -= kprof_live[i].kb_weight;
+		ks->ks_livebytes -= kprof_live[i].kb_size * kprof_live[i].kb_weight;
+		kprof_remove(i);
+		if (pr != NULL) {
+			KASSERT(pr->nsampled > 0);
+			pr->nsampled--;
+		}
+		else {
+			KASSERT(kprof_nlarge > 0);
+			kprof_nlarge--;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print, for each size class, how many pages it has and how well they
+ * are used. Blocks are in use, held in a cpu's cache, or free on their
+ * page; "waste" is the space lost to rounding requests up to the block
+ * size, estimated from the average request.
+ */
+void
+kheap_printprofile(void)
+{
+	struct pageref *pr;
+	unsigned i, cpu, pages, blocks, nfree, allocs, frees, bytes;
+	unsigned live, avg, f;
+	int cached;
+
+	kprintf("size  pages blocks in use cached   free  avg req  waste\n");
+	for (i=0; i<=NSIZES; i++) {
+		allocs = frees = bytes = 0;
+		for (cpu=0; cpu<MAXCPUS; cpu++) {
+			allocs += kprof_classes[cpu][i].kp_allocs;
+			frees += kprof_classes[cpu][i].kp_frees;
+			bytes += kprof_classes[cpu][i].kp_bytes;
+		}
+		live = allocs - frees;
+		avg = allocs == 0 ? 0 : bytes / allocs;
+
+		if (i == NSIZES) {
+			/* multi-page blocks are only tagged in the frame map */
+			blocks = pages = 0;
+			spinlock_acquire(&kmalloc_spinlock);
+			for (f=0; kheap_pagerefs != NULL && f<kheap_nframes; f++) {
+				if (KH_ISLARGE(kheap_pagerefs[f])) {
+					blocks++;
+					pages += KH_LARGEPAGES(kheap_pagerefs[f]);
+				}
+			}
+			spinlock_release(&kmalloc_spinlock);
+			kprintf("large: %u blocks in %u pages, avg req %u, "
+				"waste %u\n", blocks, pages, avg,
+				pages * PAGE_SIZE > blocks * avg ?
+				pages * PAGE_SIZE - blocks * avg : 0);
+			break;
+		}
+
+		pages = nfree = 0;
+		spinlock_acquire(&kmalloc_spinlock);
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			pages++;
+			nfree += pr->nfree;
+		}
+		spinlock_release(&kmalloc_spinlock);
+		blocks = pages * (PAGE_SIZE / sizes[i]);
+
+		/* the counters are approximate, so this can come out < 0 */
+		cached = (int)(blocks - nfree) - (int)live;
+		if (cached < 0) {
+			cached = 0;
+		}
+		kprintf("%4lu %6u %6u %6u %6d %6u %8u %6u\n",
+			(unsigned long)sizes[i], pages, blocks, live, cached,
+			nfree, avg,
+			avg < sizes[i] ? live * (sizes[i] - avg) : 0);
+	}
+}
+
+/*
+ * Print the sampled call sites, most live bytes first. Look the
+ * addresses up in the kernel image with os161-addr2line or os161-nm.
+ */
+void
+kheap_printsites(void)
+{
+	unsigned order[KPROF_SITES];
+	unsigned n, i, j, t;
+	struct kprof_site *ks;
+
+	spinlock_acquire(&kprof_lock);
+	n = kprof_nsites;
+	for (i=0; i<n; i++) {
+		order[i] = i;
+	}
+	/* insertion sort; there are only KPROF_SITES of them */
+	for (i=1; i<n; i++) {
+		for (j=i; j>0 && kprof_sites[order[j]].ks_livebytes >
+			     kprof_sites[order[j-1]].ks_livebytes; j--) {
+			t = order[j];
+			order[j] = order[j-1];
+			order[j-1] = t;
+		}
+	}
+
+	kprintf("Sampling 1 in %u small allocations, all large ones; "
+		"%u samples live, %u dropped\n",
+		kprof_period, kprof_nlive, kprof_dropped);
+	kprintf("site        samples  ~allocs   ~bytes    ~live ~live bytes\n");
+	for (i=0; i<n; i++) {
+		ks = &kprof_sites[order[i]];
+		kprintf("0x%08lx %8u %8u %8u %8u %11u\n",
+			(unsigned long)ks->ks_site, ks->ks_samples,
+			ks->ks_allocs, ks->ks_bytes, ks->ks_live,
+			ks->ks_livebytes);
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Set the sampling period; 0 turns sampling off. Blocks already
+ * sampled are still tracked until they are freed.
+ */
+void
+kheap_setsampling(unsigned period)
+{
+	kprof_period = period;
+}
+
+unsigned
+kheap_getsampling(void)
+{
+	return kprof_period;
+}
+
+////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz, vaddr_t site)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+	size_t reqsz = sz;	// what the caller asked for
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	retptr = subpage_getblock(blktype);
+	if (retptr == NULL) {
+		return NULL;
+	}
+	kprof_alloc(retptr, reqsz, blktype, site);
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, site);
+#endif
+	return retptr;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t offset;		// offset into page
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	/* No lock needed; see subpage_findpage. */
+	pr = subpage_findpage(ptraddr);
+	if (pr==NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - PR_PAGEADDR(pr);
+
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+#ifdef GUARDS
+	blocksize = sizes[blktype];
+	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+	checkguardband(ptraddr, smallerblocksize, blocksize);
+#endif
+
+	kprof_free((void *)ptraddr, blktype, pr);
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+
+	subpage_putcached(ptraddr, blktype);
+
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
+
+	return 0;
+}
+
+/*
+ * Allocate SZ bytes as a run of whole pages, recording its length in
+ * kheap_pagerefs[] so kfree knows how much to give back.
+ */
+static
+void *
+large_kmalloc(size_t sz, vaddr_t site)
+{
+	unsigned long npages;
+	vaddr_t address;
+	paddr_t frame;
+
+	/* Round up to a whole number of pages. */
+	npages = DIVROUNDUP(sz, PAGE_SIZE);
+	address = alloc_kpages(npages);
+	if (address==0) {
+		return NULL;
+	}
+	KASSERT(address % PAGE_SIZE == 0);
+
+	frame = KVADDR_TO_PADDR(address) / PAGE_SIZE;
+	spinlock_acquire(&kmalloc_spinlock);
+	if (kheap_pagerefs == NULL) {
+		kheap_init();
+	}
+	KASSERT(frame < kheap_nframes);
+	KASSERT(kheap_pagerefs[frame] == NULL);
+	kheap_pagerefs[frame] = KH_MKLARGE(npages);
+	spinlock_release(&kmalloc_spinlock);
+
+	kprof_alloc((void *)address, sz, NSIZES, site);
+	return (void *)address;
+}
+
+/*
+ * Free a block from large_kmalloc; alloc_kpages recorded the length
+ * too, so free_kpages gives back the whole extent. If the pointer
+ * isn't the start of one, return -1.
+ */
+static
+int
+large_kfree(void *ptr)
+{
+	paddr_t frame;
+
+	if ((vaddr_t)ptr % PAGE_SIZE != 0 || kheap_pagerefs == NULL) {
+		return -1;
+	}
+	frame = KVADDR_TO_PADDR((vaddr_t)ptr) / PAGE_SIZE;
+	if (frame >= kheap_nframes || !KH_ISLARGE(kheap_pagerefs[frame])) {
+		return -1;
+	}
+
+	kprof_free(ptr, NSIZES, NULL);
+
+	/* Nobody else touches this entry until the pages are freed. */
+	kheap_pagerefs[frame] = NULL;
+	free_kpages((vaddr_t)ptr);
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
+ * large_kmalloc depending on how big SZ is.
+ */
+void *
+kmalloc(size_t sz)
+{
+	size_t checksz;
+	vaddr_t site;
+
+	/* The caller, for LABELS and the profiler. */
+#ifdef __GNUC__
+	site = (vaddr_t)__builtin_return_address(0);
+#else
+#error "Don't know how to get return address with this compiler"
+#endif /* __GNUC__ */
+
+	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
+	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+		return large_kmalloc(sz, site);
+	}
+
+	return subpage_kmalloc(sz, site);
+}
+
+/*
+ * Free a block previously returned from kmalloc.
+ */
+void
+kfree(void *ptr)
+{
+	/*
+	 * Try subpage first, then a multi-page allocation. Failing
+	 * both, assume it's a page from alloc_kpages.
+	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	} else if (subpage_kfree(ptr) && large_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
@@ -0,0 +1,312 @@
+/*
+ * Object caches (slabs) on top of the kernel page allocator. See
+ * kmemcache.h for the interface.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+/*
+ * A slab is one page. This header sits at the start of the page and
+ * the objects follow it, each taking kc_stride bytes: the object,
+ * then a word used to link it on the slab's free list while it isn't
+ * in use. The link is kept outside the object so that a free object
+ * stays constructed.
+ *
+ * Objects are constructed in order from the start of the slab as
+ * they are first needed; ks_nctor counts how many have been so far.
+ * Only constructed objects go on the free list.
+ */
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	/* on kc_slabs, unless full */
+	unsigned ks_inuse;		/* objects handed out */
+	unsigned ks_nctor;		/* objects constructed */
+	void *ks_free;			/* free constructed objects */
+};
+
+/* Offset of the first object, aligned for any type */
+#define KS_FIRST  ROUNDUP(sizeof(struct kmem_slab), 8)
+
+#define KS_OBJ(kc, ks, i) \
+	((void *)((vaddr_t)(ks) + KS_FIRST + (i) * (kc)->kc_stride))
+#define KS_LINK(kc, obj) \
+	(*(void **)((vaddr_t)(obj) + (kc)->kc_stride - sizeof(void *)))
+
+/* All caches, for kmem_cache_printstats */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Get a page for a new slab. Nothing in it is constructed yet.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	KASSERT(page % PAGE_SIZE == 0);
+
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_next = NULL;
+	ks->ks_inuse = 0;
+	ks->ks_nctor = 0;
+	ks->ks_free = NULL;
+	return ks;
+}
+
+/*
+ * Destroy the objects in an unused slab and give its page back. Must
+ * be called without kc_lock, as the destructor may well free memory.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	void *obj;
+	unsigned n = 0;
+
+	KASSERT(ks->ks_inuse == 0);
+
+	for (obj = ks->ks_free; obj != NULL; obj = KS_LINK(kc, obj)) {
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(obj);
+		}
+		n++;
+	}
+	KASSERT(n == ks->ks_nctor);
+
+	ks->ks_cache = NULL;
+	free_kpages((vaddr_t)ks);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Create a cache of objects of SIZE bytes.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	kc->kc_size = size;
+	kc->kc_stride = ROUNDUP(ROUNDUP(size, sizeof(void *)) + sizeof(void *), 8);
+	kc->kc_perslab = (PAGE_SIZE - KS_FIRST) / kc->kc_stride;
+	if (kc->kc_perslab < 2) {
+		panic("kmem_cache_create: %s objects (%zu bytes) are too big\n",
+		      name, size);
+	}
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_slabs = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_ctors = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+/*
+ * Destroy a cache. Every object must have been freed.
+ */
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kp;
+	struct kmem_slab *ks;
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kp = &kmem_caches; *kp != kc; kp = &(*kp)->kc_next) {
+		KASSERT(*kp != NULL);
+	}
+	*kp = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	/* with nothing in use, every slab is on kc_slabs */
+	KASSERT(kc->kc_inuse == 0);
+	while (kc->kc_slabs != NULL) {
+		ks = kc->kc_slabs;
+		kc->kc_slabs = ks->ks_next;
+		kmem_slab_destroy(kc, ks);
+		kc->kc_nslabs--;
+	}
+	KASSERT(kc->kc_nslabs == 0);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+/*
+ * Get an object. A new object is constructed here, with kc_lock
+ * held, so the constructor must not sleep; creating locks and CVs is
+ * fine.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+
+	ks = kc->kc_slabs;
+	if (ks == NULL) {
+		/* Call alloc_kpages without kc_lock. */
+		spinlock_release(&kc->kc_lock);
+		ks = kmem_slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		ks->ks_next = kc->kc_slabs;
+		kc->kc_slabs = ks;
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+	}
+
+	if (ks->ks_free != NULL) {
+		obj = ks->ks_free;
+		ks->ks_free = KS_LINK(kc, obj);
+	}
+	else {
+		KASSERT(ks->ks_nctor < kc->kc_perslab);
+		obj = KS_OBJ(kc, ks, ks->ks_nctor);
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor(obj);
+			if (result) {
+				spinlock_release(&kc->kc_lock);
+				return NULL;
+			}
+		}
+		ks->ks_nctor++;
+		kc->kc_ctors++;
+	}
+
+	if (ks->ks_inuse == 0) {
+		KASSERT(kc->kc_nempty > 0);
+		kc->kc_nempty--;
+	}
+	ks->ks_inuse++;
+	kc->kc_inuse++;
+	if (ks->ks_inuse == kc->kc_perslab) {
+		/* full; we always allocate from the first slab */
+		KASSERT(kc->kc_slabs == ks);
+		kc->kc_slabs = ks->ks_next;
+		ks->ks_next = NULL;
+	}
+
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+/*
+ * Give an object back, still constructed. One slab with nothing in
+ * use is kept for the next allocation; beyond that, slabs that become
+ * unused are destroyed.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, **kp;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	if (ks->ks_cache != kc ||
+	    ((vaddr_t)obj - (vaddr_t)ks - KS_FIRST) % kc->kc_stride != 0) {
+		panic("kmem_cache_free: %p is not a %s object\n",
+		      obj, kc->kc_name);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(ks->ks_inuse > 0);
+	if (ks->ks_inuse == kc->kc_perslab) {
+		/* was full; it has room again */
+		ks->ks_next = kc->kc_slabs;
+		kc->kc_slabs = ks;
+	}
+	/* check just the head for freeing twice */
+	KASSERT(ks->ks_free != obj);
+	KS_LINK(kc, obj) = ks->ks_free;
+	ks->ks_free = obj;
+	ks->ks_inuse--;
+	kc->kc_inuse--;
+
+	if (ks->ks_inuse == 0) {
+		if (kc->kc_nempty > 0) {
+			for (kp = &kc->kc_slabs; *kp != ks; kp = &(*kp)->ks_next) {
+				KASSERT(*kp != NULL);
+			}
+			*kp = ks->ks_next;
+			kc->kc_nslabs--;
+			spinlock_release(&kc->kc_lock);
+
+			kmem_slab_destroy(kc, ks);
+			return;
+		}
+		kc->kc_nempty++;
+	}
+
+	spinlock_release(&kc->kc_lock);
+}
+
+/*
+ * Print how much each cache holds and how often objects were reused
+ * rather than constructed.
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kprintf("Object caches:\n");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-12s %4zu bytes, %u/page: %u in use, %u slabs "
+			"(%u unused), %u allocs, %u constructed\n",
+			kc->kc_name, kc->kc_size, kc->kc_perslab,
+			kc->kc_inuse, kc->kc_nslabs, kc->kc_nempty,
+			kc->kc_allocs, kc->kc_ctors);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,389 @@
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+
+/*
+ * Page cache for read-only pages of files, such as program text. Each
+ * entry keeps a reference to its frame, so processes running the same
+ * program share one copy of each page. A page is found by its vnode and
+ * file offset, and by the window of bytes that were read from the file:
+ * a region zeroes the part of a page outside its file data, so the same
+ * offset mapped by regions of different sizes doesn't hold the same
+ * bytes. Frames that no
+ * process maps any more stay cached until pc_reclaim() is asked to
+ * free one because memory is low.
+ *
+ * Entries don't hold a reference to their vnode. Instead pc_invalidate()
+ * drops all of a vnode's pages when the vnode is written or truncated,
+ * so later faults read the new contents, and before it is reclaimed, so
+ * an entry never outlives its vnode. Processes that already map a page
+ * keep their copy. vn_cachedpages counts each vnode's entries so that
+ * this is cheap for files with none. A fault that read a page while the
+ * file was being changed could cache stale data after the purge, so
+ * pc_insert() is given the pc_stamp() from before the read, and doesn't
+ * cache the page if any vnode has been changed since.
+ *
+ * The hash table doubles when it averages more than PC_MAX_LOAD entries
+ * a bucket and halves when it drops below one in PC_MIN_LOAD. Resizing
+ * is incremental: the old table is kept and each operation moves a few
+ * of its buckets over, so no single fault pays for rehashing everything.
+ * Until a bucket has moved, its entries are still found in the old table.
+ */
+
+#define PC_MIN_BUCKETS 32
+#define PC_MAX_LOAD    2
+#define PC_MIN_LOAD    8
+#define PC_MIGRATE     4	// old buckets moved per operation while resizing
+#define PC_HIST        8	// probe length histogram, the last counts longer
+
+struct pc_entry {
+	struct vnode *vn;
+	off_t offset;			// file offset of the start of the page
+	unsigned int window;		// bytes read from the file, see vm_fault()
+	vaddr_t frame;
+	struct pc_entry *next;
+};
+
+static struct pc_entry **pc_table;
+static unsigned int pc_size;		// buckets in pc_table, a power of two
+static struct pc_entry **pc_old;	// table being moved from, or NULL
+static unsigned int pc_oldsize;
+static unsigned int pc_moved;		// buckets of pc_old moved so far
+static struct lock *pc_lock;
+static unsigned int pc_hand;		// bucket pc_reclaim() looks at next
+static unsigned int pc_count;		// entries in the table
+static unsigned int pc_lookups;		// calls to pc_find()
+static unsigned int pc_probes;		// entries compared by them
+static unsigned int pc_hist[PC_HIST];	// lookups by entries compared
+static unsigned int pc_resizes;
+static unsigned int pc_changes;		// calls to pc_invalidate()
+
+// allocates an empty table of size buckets
+static
+struct pc_entry **
+pc_newtable(unsigned int size)
+{
+	struct pc_entry **table = kmalloc(sizeof(struct pc_entry *) * size);
+	if (table == NULL) {
+		return NULL;
+	}
+	for (unsigned int i = 0; i < size; i++) {
+		table[i] = NULL;
+	}
+	return table;
+}
+
+/* Initialization function */
+void pc_bootstrap(void)
+{
+	pc_size = PC_MIN_BUCKETS;
+	pc_table = pc_newtable(pc_size);
+	pc_old = NULL;
+	pc_hand = 0;
+
+	pc_lock = lock_create("pc_lock");
+	if (pc_table == NULL || pc_lock == NULL) {
+		panic("pagecache.c: out of memory in bootstrap\n");
+	}
+}
+
+// calculates hash from the vnode and file offset, mixed with the
+// murmur3 finaliser so that every bit depends on both
+static
+uint32_t
+pc_hash(struct vnode *vn, off_t offset)
+{
+	uint32_t h = (uint32_t) vn ^ ((uint32_t)(offset / PAGE_SIZE) * 0x9e3779b1);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+// finds the chain a key belongs in, in the old table if its bucket
+// hasn't been moved yet
+static
+struct pc_entry **
+pc_bucket(uint32_t hash)
+{
+	if (pc_old != NULL && (hash & (pc_oldsize - 1)) >= pc_moved) {
+		return &pc_old[hash & (pc_oldsize - 1)];
+	}
+	return &pc_table[hash & (pc_size - 1)];
+}
+
+// moves a few buckets of the old table over, freeing it once done
+static
+void
+pc_migrate(unsigned int nbuckets)
+{
+	while (pc_old != NULL && nbuckets-- > 0) {
+		struct pc_entry *pe = pc_old[pc_moved];
+		while (pe != NULL) {
+			struct pc_entry *next = pe->next;
+			struct pc_entry **chain =
+				&pc_table[pc_hash(pe->vn, pe->offset) & (pc_size - 1)];
+			pe->next = *chain;
+			*chain = pe;
+			pe = next;
+		}
+		pc_old[pc_moved++] = NULL;
+		if (pc_moved == pc_oldsize) {
+			kfree(pc_old);
+			pc_old = NULL;
+		}
+	}
+}
+
+// starts moving to a table of a new size if the load is out of bounds
+static
+void
+pc_checkload(void)
+{
+	unsigned int size;
+
+	if (pc_old != NULL) {
+		// still moving to the last size
+		return;
+	}
+	if (pc_count > pc_size * PC_MAX_LOAD) {
+		size = pc_size * 2;
+	} else if (pc_size > PC_MIN_BUCKETS && pc_count < pc_size / PC_MIN_LOAD) {
+		size = pc_size / 2;
+	} else {
+		return;
+	}
+
+	struct pc_entry **table = pc_newtable(size);
+	if (table == NULL) {
+		// try again on the next change
+		return;
+	}
+	pc_old = pc_table;
+	pc_oldsize = pc_size;
+	pc_moved = 0;
+	pc_table = table;
+	pc_size = size;
+	pc_resizes++;
+}
+
+static
+struct pc_entry *
+pc_find(struct vnode *vn, off_t offset, unsigned int window)
+{
+	struct pc_entry *pe;
+	unsigned int probes = 0;
+
+	pc_migrate(PC_MIGRATE);
+	for (pe = *pc_bucket(pc_hash(vn, offset)); pe != NULL; pe = pe->next) {
+		probes++;
+		if (pe->vn == vn && pe->offset == offset &&
+		    pe->window == window) {
+			break;
+		}
+	}
+
+	pc_lookups++;
+	pc_probes += probes;
+	pc_hist[probes < PC_HIST ? probes : PC_HIST - 1]++;
+	return pe;
+}
+
+// returns the cached frame for a page with a reference for the caller, or 0
+vaddr_t pc_lookup(struct vnode *vn, off_t offset, unsigned int window)
+{
+	vaddr_t frame = 0;
+
+	lock_acquire(pc_lock);
+	struct pc_entry *pe = pc_find(vn, offset, window);
+	if (pe != NULL) {
+		ft_incref(pe->frame);
+		frame = pe->frame;
+	}
+	lock_release(pc_lock);
+	return frame;
+}
+
+// returns a stamp to pass to pc_insert(), taken before reading the page
+unsigned int pc_stamp(void)
+{
+	return pc_changes;
+}
+
+/*
+ * Adds a frame the caller has just read a page into. If someone else
+ * got there first, the caller gets a reference to their frame instead
+ * and should free its own, so the return value is the frame to use.
+ * If a file changed since the stamp was taken, the frame isn't cached.
+ */
+vaddr_t pc_insert(struct vnode *vn, off_t offset, unsigned int window,
+		  vaddr_t frame, unsigned int stamp)
+{
+	lock_acquire(pc_lock);
+	struct pc_entry *pe = pc_find(vn, offset, window);
+	if (pe != NULL) {
+		ft_incref(pe->frame);
+		frame = pe->frame;
+		lock_release(pc_lock);
+		return frame;
+	}
+
+	if (stamp != pc_changes) {
+		// the page may have been read before a write, don't cache it
+		lock_release(pc_lock);
+		return frame;
+	}
+	pe = kmalloc(sizeof(struct pc_entry));
+	if (pe == NULL) {
+		// can't cache it, the caller keeps it to itself
+		lock_release(pc_lock);
+		return frame;
+	}
+	ft_incref(frame);
+	pe->vn = vn;
+	pe->offset = offset;
+	pe->window = window;
+	pe->frame = frame;
+
+	struct pc_entry **chain = pc_bucket(pc_hash(vn, offset));
+	pe->next = *chain;
+	*chain = pe;
+	pc_count++;
+	vn->vn_cachedpages++;
+	pc_checkload();
+	lock_release(pc_lock);
+	return frame;
+}
+
+/*
+ * Drops every cached page of a vnode. Called after it is written to or
+ * truncated, and before it is reclaimed.
+ */
+void pc_invalidate(struct vnode *vn)
+{
+	struct pc_entry *dropped = NULL;
+
+	// both under the lock, so that a pc_insert() of old data either
+	// happens before we look and is dropped, or sees the new count
+	lock_acquire(pc_lock);
+	pc_changes++;
+	if (vn->vn_cachedpages == 0) {
+		lock_release(pc_lock);
+		return;
+	}
+
+	pc_migrate(pc_oldsize);
+	for (unsigned int i = 0; i < pc_size && vn->vn_cachedpages > 0; i++) {
+		struct pc_entry **pp = &pc_table[i];
+		while (*pp != NULL) {
+			struct pc_entry *pe = *pp;
+			if (pe->vn != vn) {
+				pp = &pe->next;
+				continue;
+			}
+			*pp = pe->next;
+			pe->next = dropped;
+			dropped = pe;
+			pc_count--;
+			vn->vn_cachedpages--;
+		}
+	}
+	KASSERT(vn->vn_cachedpages == 0);
+	pc_checkload();
+	lock_release(pc_lock);
+
+	while (dropped != NULL) {
+		struct pc_entry *pe = dropped;
+		dropped = pe->next;
+		// only the cache's reference, processes mapping it keep theirs
+		free_kpages(pe->frame);
+		kfree(pe);
+	}
+}
+
+// frees one cached frame that no process is using, returns false if none
+bool pc_reclaim(void)
+{
+	lock_acquire(pc_lock);
+	// memory is short, so finish moving rather than search both tables
+	pc_migrate(pc_oldsize);
+	pc_hand &= pc_size - 1;
+	for (unsigned int n = 0; n < pc_size; n++) {
+		struct pc_entry **pp = &pc_table[pc_hand];
+		for (; *pp != NULL; pp = &(*pp)->next) {
+			if (ft_refcount((*pp)->frame) == 1) {
+				// only the cache holds it
+				struct pc_entry *pe = *pp;
+				*pp = pe->next;
+				pc_count--;
+				pe->vn->vn_cachedpages--;
+				pc_checkload();
+				lock_release(pc_lock);
+
+				free_kpages(pe->frame);
+				kfree(pe);
+				return true;
+			}
+		}
+		pc_hand = (pc_hand + 1) & (pc_size - 1);
+	}
+	lock_release(pc_lock);
+	return false;
+}
+
+// length of a chain, for pc_printstats()
+static
+unsigned int
+pc_chainlength(struct pc_entry *pe)
+{
+	unsigned int len = 0;
+	for (; pe != NULL; pe = pe->next) {
+		len++;
+	}
+	return len;
+}
+
+// prints how full the table is and how long lookups take
+void pc_printstats(void)
+{
+	unsigned int longest = 0, used = 0;
+
+	lock_acquire(pc_lock);
+	for (unsigned int i = 0; i < pc_size; i++) {
+		unsigned int len = pc_chainlength(pc_table[i]);
+		if (len > 0) {
+			used++;
+		}
+		if (len > longest) {
+			longest = len;
+		}
+	}
+	for (unsigned int i = pc_moved; pc_old != NULL && i < pc_oldsize; i++) {
+		unsigned int len = pc_chainlength(pc_old[i]);
+		if (len > longest) {
+			longest = len;
+		}
+	}
+	kprintf("Page cache: %u pages in %u of %u buckets, longest chain %u\n",
+		pc_count, used, pc_size, longest);
+	if (pc_old != NULL) {
+		kprintf("Page cache: resizing from %u buckets, %u moved\n",
+			pc_oldsize, pc_moved);
+	}
+	kprintf("Page cache: resized %u times\n", pc_resizes);
+
+	// average in hundredths, there's no floating point in the kernel
+	unsigned int avg = pc_lookups == 0 ? 0 : pc_probes * 100 / pc_lookups;
+	kprintf("Page cache lookups: %u, entries compared per lookup %u.%02u\n",
+		pc_lookups, avg / 100, avg % 100);
+	kprintf("Entries compared:");
+	for (unsigned int i = 0; i < PC_HIST; i++) {
+		kprintf(" %u%s: %u", i, i == PC_HIST - 1 ? "+" : "", pc_hist[i]);
+	}
+	kprintf("\n");
+	lock_release(pc_lock);
+}
@@ -0,0 +1,161 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+
+/*
+ * Swap space. Pages evicted from memory are written to page sized slots
+ * on a raw disk device, with a bitmap keeping track of the slots in use.
+ */
+
+#define SWAP_DEVICE "lhd0raw:"
+
+static struct vnode *swap_vnode = NULL;
+static struct bitmap *swap_map;
+static struct lock *swap_lock;
+static unsigned int swap_slots;
+
+// bounce buffer for swap_dup(), protected by swap_lock
+static char swap_buffer[PAGE_SIZE];
+
+/* Initialization function */
+void swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	// vfs_open can modify the path it is given
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: can't open %s (%s), running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result || st.st_size < PAGE_SIZE) {
+		kprintf("swap: %s is unusable, running without swap\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_slots = st.st_size / PAGE_SIZE;
+	if (swap_slots > SWAP_NOSLOT) {
+		// slot numbers must fit in a page table entry
+		swap_slots = SWAP_NOSLOT;
+	}
+	swap_map = bitmap_create(swap_slots);
+	swap_lock = lock_create("swap_lock");
+	if (swap_map == NULL || swap_lock == NULL) {
+		panic("swap.c: out of memory in bootstrap\n");
+	}
+
+	kprintf("swap: %u pages on %s\n", swap_slots, SWAP_DEVICE);
+}
+
+// transfers one page between memory and a swap slot
+static
+int
+swap_io(unsigned int slot, void *buf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(slot < swap_slots);
+
+	uio_kinit(&iov, &u, buf, PAGE_SIZE, (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	} else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		// short transfer, device is misbehaving
+		return EIO;
+	}
+	return 0;
+}
+
+// writes the page at kernel address frame to a newly allocated slot
+int swap_out(vaddr_t frame, unsigned int *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	lock_acquire(swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	lock_release(swap_lock);
+	if (result) {
+		// swap is full
+		return result;
+	}
+
+	result = swap_io(*slot, (void *)frame, UIO_WRITE);
+	if (result) {
+		swap_free(*slot);
+		return result;
+	}
+	return 0;
+}
+
+// reads a slot back into the page at kernel address frame
+int swap_in(unsigned int slot, vaddr_t frame)
+{
+	KASSERT(swap_vnode != NULL);
+	return swap_io(slot, (void *)frame, UIO_READ);
+}
+
+// releases a slot that no page table entry refers to any more
+void swap_free(unsigned int slot)
+{
+	KASSERT(swap_vnode != NULL);
+
+	lock_acquire(swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	lock_release(swap_lock);
+}
+
+// copies the contents of a slot into a newly allocated one
+int swap_dup(unsigned int slot, unsigned int *newslot)
+{
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+
+	lock_acquire(swap_lock);
+	result = bitmap_alloc(swap_map, newslot);
+	if (result) {
+		lock_release(swap_lock);
+		return result;
+	}
+
+	result = swap_io(slot, swap_buffer, UIO_READ);
+	if (result == 0) {
+		result = swap_io(*newslot, swap_buffer, UIO_WRITE);
+	}
+	if (result) {
+		bitmap_unmark(swap_map, *newslot);
+	}
+	lock_release(swap_lock);
+	return result;
+}
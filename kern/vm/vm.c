@@ -9,46 +9,157 @@
 #include <current.h>
 #include <spl.h>
 #include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
 
-// used for hash
 #define PAGE_BITS  12
 
-#define USER_STACK_SIZE 16 * PAGE_SIZE
+/*
+ * Two-level page table. The top bits of a user address index a
+ * directory of PT_DIR_SIZE pointers, and the next bits index a page of
+ * PT_LEAF_SIZE entries, so both levels take exactly one page. Leaves are
+ * only allocated once a page in their range is used.
+ */
+#define PT_LEAF_BITS  9
+#define PT_LEAF_SIZE  (1 << PT_LEAF_BITS)
+#define PT_DIR_SIZE   (MIPS_KSEG0 >> (PAGE_BITS + PT_LEAF_BITS))
 
-static struct lock *pagetable_lock;
+#define PT_DIR_INDEX(va)   ((va) >> (PAGE_BITS + PT_LEAF_BITS))
+#define PT_LEAF_INDEX(va)  (((va) >> PAGE_BITS) & (PT_LEAF_SIZE - 1))
 
-/* Page Table Entry */
-struct PTE {
-	int write;			// write permission bit
-	vaddr_t page;
-	vaddr_t frame;
-	uint32_t pid;
+/*
+ * Page Table Entry, unused while frame is 0 and slot is SWAP_NOSLOT.
+ * written is set once this address space may have written the page. A
+ * frame's dirty bit can't tell, since a frame shared since fork carries
+ * the writes of the process that made it dirty, and vm_writeback() must
+ * only write back the pages a process changed itself.
+ */
+struct pte {
+	vaddr_t frame;			// 0 when the page is in swap
+	unsigned int slot : 31;		// swap slot with a copy of the page, or SWAP_NOSLOT
+	unsigned int written : 1;
 };
 
-static struct PTE *pagetable;
-static uint32_t num_pages;
+/*
+ * Held while evicting a page. The frame table names the owner of a
+ * victim by its address space, so as_destroy() takes this lock too and
+ * the address space can't disappear while its page is being evicted.
+ */
+static struct lock *evict_lock;
+
+/*
+ * TLB shootdowns. A page whose mapping changes has to leave the TLB of
+ * every cpu, not just this one, before its frame can be reused: other
+ * cpus may have run the address space, and with address space IDs their
+ * entries stay valid after it stops running there. vm_tlbinvalidate()
+ * sends a shootdown to the other cpus and sleeps on ts_sem until each of
+ * them has done it. ts_lock lets only one shootdown be in flight, so no
+ * cpu ever has more than one queued.
+ */
+static struct lock *ts_lock;
+static struct semaphore *ts_sem;
+
+/*
+ * Address space IDs. Each address space is tagged with an ID that goes
+ * in the TLBHI_PID field of its TLB entries, so they can stay in the TLB
+ * while other processes run. IDs are handed out in order from one pool
+ * for all cpus; once they run out a new generation starts and every
+ * address space is given a new ID the next time it is activated. Each
+ * cpu notes in its struct cpu the generation its TLB holds entries of,
+ * and flushes its TLB before it first uses an ID of a newer one, so an
+ * ID handed out again never matches entries left over from its last
+ * owner. ID 0 is never used. Protected by asid_lock.
+ */
+#define ASID_BITS  6
+#define ASID_COUNT (1 << ASID_BITS)
+
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
+
+/*
+ * Fault-around. After a TLB miss, up to fa_window of the following pages
+ * that are already in memory are loaded into the TLB too, so sequential
+ * scans miss once per window instead of once per page. Kept well below
+ * NUM_TLB since every prefetched entry replaces a random one.
+ */
+#define FA_MAX_WINDOW (NUM_TLB / 4)
+
+static unsigned int fa_window = 4;
+
+/*
+ * Software superpages. MIPS TLB entries only map 4K, so instead the
+ * first fault in a large writable anonymous area gives a whole aligned
+ * run of SP_PAGES pages physically contiguous frames at once, and a miss
+ * on any page of a run loads the whole run into the TLB. The pages keep
+ * their own page table entries so they can still be shared and evicted
+ * one by one; a run is recognised by its frames being contiguous.
+ */
+#define SP_ORDER 4
+#define SP_PAGES (1 << SP_ORDER)
+#define SP_SIZE  (SP_PAGES * PAGE_SIZE)
+
+static bool sp_enabled = true;
+static struct spinlock sp_lock = SPINLOCK_INITIALIZER;
+static unsigned int sp_runs;		// runs allocated
+static unsigned int sp_fallbacks;	// runs wanted but no contiguous memory
 
-uint32_t hpt_hash(uint32_t pid, vaddr_t faultaddr);
-uint32_t hpt_indexof(uint32_t pid, vaddr_t faultaddr);
+// stack limit given to new address spaces, changed from the menu since
+// there's no setrlimit()
+static size_t stack_limit = STACK_LIMIT_DEFAULT;
+
+static struct pte *pt_lookup(struct addrspace *as, vaddr_t page, bool create);
+static int vm_permission(struct addrspace *as, vaddr_t page, int *write);
+/*
+ * Counters of VM events, per cpu so that counting needs no lock, in a
+ * fixed-size array like the one in mips/cpu.c. Each address space also
+ * counts its own, which can be printed when its process exits.
+ */
+static unsigned int vm_cpustats[MAXCPUS][VMS_NUM];
+static bool vm_exitstats = false;
+
+static const char *const vm_eventnames[VMS_NUM] = {
+	[VMS_TLBMISS] = "TLB misses",
+	[VMS_REFILL] = "  refilled without a fault",
+	[VMS_FAULT_READ] = "Read faults",
+	[VMS_FAULT_WRITE] = "Write faults",
+	[VMS_FAULT_READONLY] = "Readonly faults",
+	[VMS_ZEROFILL] = "Pages zero-filled",
+	[VMS_FILEREAD] = "Pages read from files",
+	[VMS_CACHEHIT] = "Pages from the page cache",
+	[VMS_RUN] = "Superpage runs",
+	[VMS_SWAPIN] = "Pages swapped in",
+	[VMS_SWAPOUT] = "Pages swapped out",
+	[VMS_DROP] = "Clean pages dropped",
+	[VMS_COPY] = "Copy-on-write copies",
+};
+
+static void vm_count(struct addrspace *as, enum vm_event event);
+static void vm_faultaround(struct addrspace *as, vaddr_t faultaddress);
+static void vm_allocrun(struct addrspace *as, vaddr_t faultaddress);
+static bool vm_loadrun(struct addrspace *as, vaddr_t faultaddress);
+static void vm_filewindow(struct region *reg, vaddr_t page,
+			  vaddr_t *start, vaddr_t *end);
+static int vm_loadpage(struct region *reg, vaddr_t page, vaddr_t frame);
+static vaddr_t vm_getframe(void);
+static int vm_evict(void);
 
 void
 vm_bootstrap(void)
 {
-	/* page table initialisation */
-	num_pages = ram_getsize() / PAGE_SIZE * 2;
-	pagetable = kmalloc(sizeof(struct PTE) * num_pages);
-	for (uint32_t i = 0; i < num_pages; i++) {
-		pagetable[i].write = 0;
-		pagetable[i].page  = 0;
-		pagetable[i].frame = 0;
-		pagetable[i].pid   = 0;
-	}
-	pagetable_lock = lock_create("pt_lock");
-	if (pagetable_lock == NULL) {
+	evict_lock = lock_create("evict_lock");
+	ts_lock = lock_create("ts_lock");
+	ts_sem = sem_create("ts_sem", 0);
+	if (evict_lock == NULL || ts_lock == NULL || ts_sem == NULL) {
 		panic("vm.c: lock create failed\n");
 	}
 
 	ft_bootstrap();
+	as_bootstrap();
+	pc_bootstrap();
+	swap_bootstrap();
 }
 
 int
@@ -60,7 +171,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 		case VM_FAULT_READONLY:
-		return EFAULT;
 		case VM_FAULT_READ:
 		case VM_FAULT_WRITE:
 		break;
@@ -86,7 +196,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	if (as->start == NULL) {
+	if (as->nregions == 0) {
 		/*
 		 * No regions set up. This is probably also a
 		 * kernel fault early in boot.
@@ -94,205 +204,1049 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	int write = 0;
-	// check which region the address is in and the
-	// corresponding permissions
-	struct region *cur_region = as->start;
-	while (cur_region != NULL) {
-		if (faultaddress >= cur_region->base) {
-			if (faultaddress - cur_region->base < cur_region->size) {
-				write = cur_region->write;
-				break;
-			}
-		}
-		cur_region = cur_region->next;
+	switch (faulttype) {
+		case VM_FAULT_READ:
+		vm_count(as, VMS_FAULT_READ);
+		break;
+		case VM_FAULT_WRITE:
+		vm_count(as, VMS_FAULT_WRITE);
+		break;
+		case VM_FAULT_READONLY:
+		vm_count(as, VMS_FAULT_READONLY);
+		break;
 	}
 
-	if (cur_region == NULL) {
-		// no region matching the faultaddress
-		if (faultaddress < as->stack_end && faultaddress > (as->stack_end - USER_STACK_SIZE)) {
-			// location is in stack
-			write = 1;
-		} else {
-			return EFAULT;
-		}
+	int write;
+	if (vm_permission(as, faultaddress, &write)) {
+		return EFAULT;
+	}
+
+	if (faulttype == VM_FAULT_READONLY && !write) {
+		// write to a page that really is read-only
+		return EFAULT;
 	}
 
+	if (faultaddress < as->stack_start &&
+	    as->stack_end - faultaddress <= as->stack_limit) {
+		// stack growing down, its new pages are zero-filled below
+		as->stack_start = faultaddress;
+	}
 
-	lock_acquire(pagetable_lock);
-	// find matching entry in page table
-	uint32_t index = hpt_indexof((uint32_t) as, faultaddress);
+	if (sp_enabled && faulttype != VM_FAULT_READONLY) {
+		vm_allocrun(as, faultaddress);
+	}
 
-	if (index == num_pages) {
-		// no space remaining
-		lock_release(pagetable_lock);
-		return ENOMEM;
+	// read-only pages of a file are shared through the page cache
+	struct region *reg = as_findregion(as, faultaddress);
+	bool cached = reg != NULL && reg->vnode != NULL && !reg->write;
+	off_t offset = 0;
+	unsigned int window = 0;
+	if (cached) {
+		offset = reg->offset + ((off_t)faultaddress - (off_t)reg->filebase);
+		// the page also depends on how much of it comes from the file
+		vaddr_t start, end;
+		vm_filewindow(reg, faultaddress, &start, &end);
+		if (start < end) {
+			window = ((start - faultaddress) << 16) | (end - faultaddress);
+		}
+	}
+
+	lock_acquire(as->pt_lock);
+	struct pte *pte;
+	vaddr_t newframe = 0;
+	while (1) {
+		pte = pt_lookup(as, faultaddress, true);
+		if (pte == NULL) {
+			lock_release(as->pt_lock);
+			if (newframe != 0) {
+				free_kpages(newframe);
+			}
+			return ENOMEM;
+		}
+		if (cached && pte->frame == 0 && pte->slot == SWAP_NOSLOT) {
+			// another process may have read the page in already
+			pte->frame = pc_lookup(reg->vnode, offset, window);
+			if (pte->frame != 0) {
+				vm_count(as, VMS_CACHEHIT);
+			}
+		}
+		bool needframe = pte->frame == 0 ||
+			(faulttype == VM_FAULT_READONLY && ft_refcount(pte->frame) > 1);
+		if (!needframe || newframe != 0) {
+			break;
+		}
+		// getting a frame can evict a page from any address space,
+		// including this one, so it's done without holding our lock
+		lock_release(as->pt_lock);
+		newframe = vm_getframe();
+		if (newframe == 0) {
+			return ENOMEM;
+		}
+		lock_acquire(as->pt_lock);
 	}
 
-	if (pagetable[index].pid == 0) {
-		// no entry in page table yet
-		pagetable[index].write = write;
-		pagetable[index].page  = faultaddress;
-		pagetable[index].frame = alloc_kpages(1);
-		pagetable[index].pid   = (uint32_t) as;
+	if (pte->frame == 0 && pte->slot == SWAP_NOSLOT) {
+		// no entry in page table yet, or a clean page that was dropped
+		unsigned int stamp = pc_stamp();
+		if (reg != NULL && reg->vnode != NULL && reg->filesize > 0 &&
+		    faultaddress < reg->filebase + reg->filesize &&
+		    faultaddress + PAGE_SIZE > reg->filebase) {
+			int result = vm_loadpage(reg, faultaddress, newframe);
+			if (result) {
+				lock_release(as->pt_lock);
+				free_kpages(newframe);
+				return result;
+			}
+			vm_count(as, VMS_FILEREAD);
+		} else {
+			vm_count(as, VMS_ZEROFILL);
+		}
+		if (cached) {
+			// if the page was cached meanwhile this gives us that frame
+			pte->frame = pc_insert(reg->vnode, offset, window,
+					       newframe, stamp);
+			if (pte->frame == newframe) {
+				newframe = 0;
+			}
+		} else {
+			pte->frame = newframe;
+			newframe = 0;
+		}
+	} else if (pte->frame == 0) {
+		// page was evicted, read it back in from swap
+		int result = swap_in(pte->slot, newframe);
+		if (result) {
+			lock_release(as->pt_lock);
+			free_kpages(newframe);
+			return result;
+		}
+		// the slot is kept, so the page needn't be written again while clean
+		pte->frame = newframe;
+		newframe = 0;
+		vm_count(as, VMS_SWAPIN);
+	} else if (faulttype == VM_FAULT_READONLY && ft_refcount(pte->frame) > 1) {
+		// first write to a frame shared since fork, take a private copy
+		memcpy((void *)newframe, (void *)pte->frame, PAGE_SIZE);
+		// other cpus may still map the page to the shared frame
+		vm_tlbinvalidate(as, faultaddress);
+		// drops our reference to the shared frame
+		free_kpages(pte->frame);
+		pte->frame = newframe;
+		newframe = 0;
+		vm_count(as, VMS_COPY);
+	}
+	if (newframe != 0) {
+		// the page changed while we were getting a frame, not needed
+		free_kpages(newframe);
 	}
 
-	paddr_t paddr = KVADDR_TO_PADDR(pagetable[index].frame);
-	lock_release(pagetable_lock);
+	paddr_t paddr = KVADDR_TO_PADDR(pte->frame);
+	// shared frames stay read-only so that a write comes back here
+	bool dirty = false;
+	if (ft_refcount(pte->frame) == 1) {
+		// frame belongs to this process alone, so it can be evicted
+		ft_setowner(pte->frame, (uint32_t) as, faultaddress);
+		bool writing = write && faulttype != VM_FAULT_READ;
+		if (writing && pte->slot != SWAP_NOSLOT) {
+			// copy in swap is about to go out of date
+			swap_free(pte->slot);
+			pte->slot = SWAP_NOSLOT;
+		}
+		if (writing) {
+			pte->written = 1;
+		}
+		// clean pages, and pages we haven't written ourselves, are
+		// mapped read-only to catch the first write
+		dirty = ft_touch(pte->frame, writing) && write && pte->written;
+	} else {
+		ft_touch(pte->frame, false);
+	}
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+	/*
+	 * Disable interrupts on this CPU while frobbing the TLB. The page
+	 * table lock is still held so the frame can't be evicted before
+	 * the entry is in the TLB.
+	 */
 	int spl = splhigh();
-	int ehi = faultaddress;
+	int ehi = faultaddress | curcpu->c_asid;
 	int elo = paddr | TLBLO_VALID;
-	if (write) {
+	if (dirty) {
 		elo |= TLBLO_DIRTY;
 	}
 	DEBUG(DB_VM, "vm.c: 0x%x -> 0x%x\n", faultaddress, paddr);
-	tlb_random(ehi, elo);
+	// a readonly fault leaves the old entry in the TLB, so replace it
+	int slot = tlb_probe(ehi, 0);
+	if (slot >= 0) {
+		tlb_write(ehi, elo, slot);
+	} else {
+		tlb_random(ehi, elo);
+	}
+	if (faulttype != VM_FAULT_READONLY) {
+		vm_faultaround(as, faultaddress);
+	}
+	splx(spl);
+	lock_release(as->pt_lock);
+	return 0;
+}
+
+/*
+ * Fast path for TLB misses on pages that are already in memory, called
+ * from mips_trap() before vm_fault(). It reads the page table without
+ * taking its lock, relying on interrupts being off and on ft_refill()
+ * confirming that the frame still holds this page. Anything else,
+ * including a first write to a clean page, returns an error so that
+ * the caller falls back to vm_fault().
+ */
+int
+vm_tlbrefill(vaddr_t faultaddress, bool writing)
+{
+	faultaddress &= PAGE_FRAME;
+
+	if (curproc == NULL || faultaddress >= MIPS_KSEG0) {
+		return EFAULT;
+	}
+	struct addrspace *as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	vm_count(as, VMS_TLBMISS);
+
+	int write;
+	if (vm_permission(as, faultaddress, &write)) {
+		return EFAULT;
+	}
+
+	int spl = splhigh();
+	struct pte *leaf = as->pagetable[PT_DIR_INDEX(faultaddress)];
+	vaddr_t frame = leaf == NULL ? 0 : leaf[PT_LEAF_INDEX(faultaddress)].frame;
+	bool dirty;
+	if (frame == 0 || !ft_refill(frame, (uint32_t) as, faultaddress, &dirty) ||
+			(writing && !(write && dirty &&
+				      leaf[PT_LEAF_INDEX(faultaddress)].written))) {
+		splx(spl);
+		return EFAULT;
+	}
+	// ft_refill() takes any shared frame, so make sure ours still is it
+	if (leaf[PT_LEAF_INDEX(faultaddress)].frame != frame) {
+		splx(spl);
+		return EFAULT;
+	}
+
+	int elo = KVADDR_TO_PADDR(frame) | TLBLO_VALID;
+	if (write && dirty && leaf[PT_LEAF_INDEX(faultaddress)].written) {
+		elo |= TLBLO_DIRTY;
+	}
+	// it's a miss, so the page can't already be in the TLB
+	tlb_random(faultaddress | curcpu->c_asid, elo);
+	vm_faultaround(as, faultaddress);
 	splx(spl);
+	vm_count(as, VMS_REFILL);
 	return 0;
 }
 
-// frees frames in use by a given process
+/*
+ * Loads the pages following a miss into the TLB, if they are already in
+ * memory and not in the TLB yet. Called with interrupts off, and like
+ * vm_tlbrefill() it reads the page table without the lock and relies on
+ * ft_prefetch() to check the frame is still ours.
+ */
+static
 void
-vm_freeproc(uint32_t pid)
+vm_faultaround(struct addrspace *as, vaddr_t faultaddress)
 {
-	if (pid == 0) {
-		// input is invalid
+	if (sp_enabled && vm_loadrun(as, faultaddress)) {
 		return;
 	}
-	lock_acquire(pagetable_lock);
-	for (uint32_t i = 0; i < num_pages; i++) {
-		if (pagetable[i].pid == pid) {
-			// pte with given pid found, freeing page
-			KASSERT((pagetable[i].page & PAGE_FRAME) == pagetable[i].page);
-			free_kpages(pagetable[i].frame);
-			pagetable[i].write = 0;
-			pagetable[i].page  = 0;
-			pagetable[i].frame = 0;
-			pagetable[i].pid   = 0;
-
-			uint32_t gap = i;
-
-			// shift pages further on in hash table if their hash is before their current position
-			for (uint32_t j = i + 1; pagetable[j].pid != 0; j++) {
-				// all page entries should be page aligned
-				KASSERT((pagetable[j].frame & PAGE_FRAME) == pagetable[j].frame);
-				if (hpt_indexof(pid, pagetable[j].frame) == gap) {
-					// move page entry to the gap
-					pagetable[gap].write = pagetable[j].write;
-					pagetable[gap].page  = pagetable[j].page;
-					pagetable[gap].frame = pagetable[j].frame;
-					pagetable[gap].pid   = pagetable[j].pid;
-
-					pagetable[j].write = 0;
-					pagetable[j].page  = 0;
-					pagetable[j].frame = 0;
-					pagetable[j].pid   = 0;
-					gap = j;
-				}
-				if (j == num_pages) {
-					// reached end of array, loop back to beginning
-					j = 0;
-					continue;
-				}
-				if (j == i) {
-					// traversed through whole array, everything has been shifted
-					break;
-				}
-			}
+
+	for (unsigned int n = 1; n <= fa_window; n++) {
+		vaddr_t page = faultaddress + n * PAGE_SIZE;
+		int write;
+		if (page >= MIPS_KSEG0 || vm_permission(as, page, &write)) {
+			// not part of any region
+			break;
+		}
+
+		struct pte *leaf = as->pagetable[PT_DIR_INDEX(page)];
+		vaddr_t frame = leaf == NULL ? 0 : leaf[PT_LEAF_INDEX(page)].frame;
+		bool dirty;
+		// there must never be two entries for the same page
+		if (frame == 0 || tlb_probe(page | curcpu->c_asid, 0) >= 0 ||
+				!ft_prefetch(frame, (uint32_t) as, page, &dirty) ||
+				leaf[PT_LEAF_INDEX(page)].frame != frame) {
+			continue;
+		}
+
+		int elo = KVADDR_TO_PADDR(frame) | TLBLO_VALID;
+		if (write && dirty && leaf[PT_LEAF_INDEX(page)].written) {
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_random(page | curcpu->c_asid, elo);
+	}
+}
+
+// whether the aligned run starting at group is all in the heap or in the
+// zero-filled part of one writable region, so it can be a superpage
+static
+bool
+vm_runable(struct addrspace *as, vaddr_t group)
+{
+	vaddr_t end = group + SP_SIZE;
+	if (group >= as->heap_start && end <= as->heap_end) {
+		return true;
+	}
+	struct region *reg = as_findregion(as, group);
+	return reg != NULL && reg->write && end - reg->base <= reg->size &&
+		(reg->vnode == NULL || group >= reg->filebase + reg->filesize);
+}
+
+// whether none of the pages of a run starting at pte are in use
+static
+bool
+vm_runempty(struct pte *pte)
+{
+	for (unsigned int i = 0; i < SP_PAGES; i++) {
+		if (pte[i].frame != 0 || pte[i].slot != SWAP_NOSLOT) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// gives the run around a faulting page all of its frames at once, if it
+// can be a superpage and none of its pages are in use yet
+static
+void
+vm_allocrun(struct addrspace *as, vaddr_t faultaddress)
+{
+	vaddr_t group = faultaddress & ~(vaddr_t)(SP_SIZE - 1);
+	if (!vm_runable(as, group)) {
+		return;
+	}
+	// a quick look without the lock, so a run isn't allocated for nothing
+	struct pte *leaf = as->pagetable[PT_DIR_INDEX(group)];
+	if (leaf != NULL && !vm_runempty(&leaf[PT_LEAF_INDEX(group)])) {
+		return;
+	}
+
+	// only takes free memory, a single page can still be had by evicting
+	vaddr_t run = alloc_urun(SP_ORDER);
+	if (run == 0) {
+		spinlock_acquire(&sp_lock);
+		sp_fallbacks++;
+		spinlock_release(&sp_lock);
+		return;
+	}
+
+	lock_acquire(as->pt_lock);
+	// runs never cross a leaf, since SP_PAGES divides PT_LEAF_SIZE
+	struct pte *pte = pt_lookup(as, group, true);
+	if (pte == NULL || !vm_runempty(pte)) {
+		lock_release(as->pt_lock);
+		for (unsigned int i = 0; i < SP_PAGES; i++) {
+			free_kpages(run + i * PAGE_SIZE);
+		}
+		return;
+	}
+	for (unsigned int i = 0; i < SP_PAGES; i++) {
+		pte[i].frame = run + i * PAGE_SIZE;
+		ft_setowner(pte[i].frame, (uint32_t) as, group + i * PAGE_SIZE);
+	}
+	lock_release(as->pt_lock);
+
+	spinlock_acquire(&sp_lock);
+	sp_runs++;
+	spinlock_release(&sp_lock);
+	vm_count(as, VMS_RUN);
+}
+
+/*
+ * If a page is part of a run whose frames are all still in place, loads
+ * the rest of the run into the TLB and returns true. Called with
+ * interrupts off, with the same rules as vm_faultaround().
+ */
+static
+bool
+vm_loadrun(struct addrspace *as, vaddr_t faultaddress)
+{
+	vaddr_t group = faultaddress & ~(vaddr_t)(SP_SIZE - 1);
+	struct pte *leaf = as->pagetable[PT_DIR_INDEX(group)];
+	if (leaf == NULL) {
+		return false;
+	}
+	struct pte *pte = &leaf[PT_LEAF_INDEX(group)];
+	vaddr_t run = pte[0].frame;
+	if (run == 0 || (KVADDR_TO_PADDR(run) & (SP_SIZE - 1)) != 0) {
+		return false;
+	}
+	for (unsigned int i = 1; i < SP_PAGES; i++) {
+		if (pte[i].frame != run + i * PAGE_SIZE) {
+			return false;
+		}
+	}
+
+	int write;
+	if (vm_permission(as, group, &write)) {
+		return false;
+	}
+	for (unsigned int i = 0; i < SP_PAGES; i++) {
+		vaddr_t page = group + i * PAGE_SIZE;
+		bool dirty;
+		if (page == faultaddress || tlb_probe(page | curcpu->c_asid, 0) >= 0 ||
+				!ft_prefetch(run + i * PAGE_SIZE, (uint32_t) as, page, &dirty) ||
+				pte[i].frame != run + i * PAGE_SIZE) {
+			continue;
 		}
+
+		int elo = KVADDR_TO_PADDR(run + i * PAGE_SIZE) | TLBLO_VALID;
+		if (write && dirty && pte[i].written) {
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_random(page | curcpu->c_asid, elo);
+	}
+	return true;
+}
+
+// turns superpage runs on or off for faults from now on
+void
+vm_setsuperpages(bool enabled)
+{
+	sp_enabled = enabled;
+}
+
+void
+vm_printsuperpages(void)
+{
+	unsigned int runs, fallbacks;
+
+	spinlock_acquire(&sp_lock);
+	runs = sp_runs;
+	fallbacks = sp_fallbacks;
+	spinlock_release(&sp_lock);
+
+	kprintf("Superpages: %s, %u pages (%u KB) per run\n",
+		sp_enabled ? "on" : "off", SP_PAGES, SP_SIZE / 1024);
+	kprintf("Runs allocated: %u\n", runs);
+	kprintf("Runs that fell back to single pages: %u\n", fallbacks);
+}
+
+// sets how many pages after a miss are loaded into the TLB, 0 to disable
+int
+vm_setfaultaround(unsigned int window)
+{
+	if (window > FA_MAX_WINDOW) {
+		return EINVAL;
 	}
-	lock_release(pagetable_lock);
+	fa_window = window;
+	return 0;
+}
+
+void
+vm_printfaultaround(void)
+{
+	unsigned int count, missed;
+
+	ft_prefetchstats(&count, &missed);
+	kprintf("Fault-around window: %u pages (at most %u)\n",
+		fa_window, FA_MAX_WINDOW);
+	kprintf("Pages loaded into the TLB ahead of use: %u\n", count);
+	kprintf("Of those, missed on anyway: %u\n", missed);
 }
 
-// clones the pages of a process to another's pid
+// sets the stack limit of address spaces created from now on, in bytes
 int
-vm_cloneproc(uint32_t oldpid, uint32_t newpid)
+vm_setstacklimit(size_t limit)
 {
-	if (oldpid == 0 || newpid == 0) {
-		// input is invalid
-		return EFAULT;
+	if (limit == 0 || limit > STACK_LIMIT_MAX) {
+		return EINVAL;
+	}
+	stack_limit = (limit + PAGE_SIZE - 1) & PAGE_FRAME;
+	return 0;
+}
+
+size_t
+vm_getstacklimit(void)
+{
+	return stack_limit;
+}
+
+// finds the part of a page that vm_loadpage() reads from the file, the
+// rest is left zero. start >= end if the page is all bss
+static
+void
+vm_filewindow(struct region *reg, vaddr_t page, vaddr_t *start, vaddr_t *end)
+{
+	*start = page > reg->filebase ? page : reg->filebase;
+	*end = page + PAGE_SIZE;
+	if (*end > reg->filebase + reg->filesize) {
+		*end = reg->filebase + reg->filesize;
+	}
+}
+
+// reads the part of a page that comes from the file behind its region into
+// a frame, the rest of which is already zeroed
+static
+int
+vm_loadpage(struct region *reg, vaddr_t page, vaddr_t frame)
+{
+	vaddr_t start, end;
+	vm_filewindow(reg, page, &start, &end);
+	if (start >= end) {
+		// page is all bss
+		return 0;
+	}
+
+	struct iovec iov;
+	struct uio u;
+	uio_kinit(&iov, &u, (void *)(frame + (start - page)), end - start,
+		reg->offset + (start - reg->filebase), UIO_READ);
+	int result = VOP_READ(reg->vnode, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on page - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+// finds whether an address is in a region or the stack and if it's writable
+static
+int
+vm_permission(struct addrspace *as, vaddr_t page, int *write)
+{
+	// check which region the address is in and the
+	// corresponding permissions
+	struct region *cur_region = as_findregion(as, page);
+	if (cur_region != NULL) {
+		*write = cur_region->write;
+		return 0;
+	}
+
+	if (page >= as->heap_start && page < as->heap_end) {
+		// heap, which is always writable
+		*write = 1;
+		return 0;
+	}
+
+	// no region matching the faultaddress
+	if (page < as->stack_end && as->stack_end - page <= as->stack_limit) {
+		// location is in stack, or where it can grow to
+		*write = 1;
+		return 0;
+	}
+	return EFAULT;
+}
+
+// finds the entry for a page, allocating its leaf if create is set
+static
+struct pte *
+pt_lookup(struct addrspace *as, vaddr_t page, bool create)
+{
+	KASSERT(lock_do_i_hold(as->pt_lock));
+	KASSERT(page < MIPS_KSEG0);
+
+	struct pte **leaf = &as->pagetable[PT_DIR_INDEX(page)];
+	if (*leaf == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		*leaf = kmalloc(sizeof(struct pte) * PT_LEAF_SIZE);
+		if (*leaf == NULL) {
+			return NULL;
+		}
+		for (unsigned int i = 0; i < PT_LEAF_SIZE; i++) {
+			(*leaf)[i].frame = 0;
+			(*leaf)[i].slot  = SWAP_NOSLOT;
+			(*leaf)[i].written = 0;
+		}
+	}
+	return &(*leaf)[PT_LEAF_INDEX(page)];
+}
+
+// gets a frame for a user page, evicting another page to swap if needed
+static
+vaddr_t
+vm_getframe(void)
+{
+	vaddr_t frame;
+	while ((frame = alloc_upage()) == 0) {
+		// cached file pages nobody is using are cheapest to give up
+		if (!pc_reclaim() && vm_evict()) {
+			// nothing left to evict, dip into the kernel's reserve
+			return alloc_kpages(1);
+		}
 	}
-	lock_acquire(pagetable_lock);
-	for (uint32_t i = 0; i < num_pages; i++) {
-		if (pagetable[i].pid == oldpid) {
-			// PTE with given pid found, create a copy with the new pid
-			KASSERT((pagetable[i].page & PAGE_FRAME) == pagetable[i].page);
-			uint32_t index = hpt_indexof(newpid, pagetable[i].page);
-			if (index == num_pages) {
-				// no space found, page table full
-				lock_release(pagetable_lock);
-				vm_freeproc(newpid);
-				return ENOMEM;
+	return frame;
+}
+
+// writes one user page out to swap and frees its frame
+static
+int
+vm_evict(void)
+{
+	uint32_t pid;
+	vaddr_t page;
+	vaddr_t frame;
+	int result = ENOMEM;
+
+	lock_acquire(evict_lock);
+	while ((frame = ft_victim(&pid, &page)) != 0) {
+		struct addrspace *as = (struct addrspace *) pid;
+		lock_acquire(as->pt_lock);
+		struct pte *pte = pt_lookup(as, page, false);
+		if (pte == NULL || pte->frame != frame || ft_refcount(frame) != 1) {
+			// page changed after the victim was chosen
+			lock_release(as->pt_lock);
+			continue;
+		}
+		// keeps vm_tlbrefill() from mapping the page while it's written out
+		ft_setowner(frame, 0, 0);
+		// and no cpu can write to it through an old entry from now on
+		vm_tlbinvalidate(as, page);
+
+		/*
+		 * A clean page is the same as its copy in swap, or if it has
+		 * none, as what the next fault would read from the file or
+		 * zero-fill, so only dirty pages are written out. The page may
+		 * have been written since it was picked, so check again now
+		 * that its page table is locked.
+		 */
+		if (ft_dirty(frame)) {
+			KASSERT(pte->slot == SWAP_NOSLOT);
+			unsigned int slot;
+			result = swap_out(frame, &slot);
+			if (result) {
+				ft_setowner(frame, pid, page);
+				lock_release(as->pt_lock);
+				break;
 			}
-			// copy original PTE data to the new PTE
-			pagetable[index].write = pagetable[i].write;
-			pagetable[index].page  = pagetable[i].page;
-			pagetable[index].frame = alloc_kpages(1);
-			pagetable[index].pid   = newpid;
-			// copy data from memory into the new page
-			if (memcpy((void *)pagetable[index].frame, (void *)pagetable[i].frame,
-					PAGE_SIZE) == NULL) {
-				// memcpy failed, roll back changes
-				lock_release(pagetable_lock);
-				vm_freeproc(newpid);
-				return ENOMEM;
+			pte->slot = slot;
+			vm_count(as, VMS_SWAPOUT);
+		} else {
+			vm_count(as, VMS_DROP);
+		}
+
+		pte->frame = 0;
+		lock_release(as->pt_lock);
+		free_kpages(frame);
+		result = 0;
+		break;
+	}
+	lock_release(evict_lock);
+	return result;
+}
+
+// counts an event on this cpu, and for the address space it happened to
+static
+void
+vm_count(struct addrspace *as, enum vm_event event)
+{
+	int spl = splhigh();
+	vm_cpustats[curcpu->c_number][event]++;
+	splx(spl);
+	if (as != NULL) {
+		// not locked, so a count might be lost to a concurrent eviction
+		as->vmstats[event]++;
+	}
+}
+
+/*
+ * Prints the VM counters, totalled and for each cpu that has counted
+ * anything, followed by the frame table and page cache figures.
+ */
+void
+vm_printstats(void)
+{
+	unsigned int ncpus = 1;
+	for (unsigned int c = 0; c < MAXCPUS; c++) {
+		for (unsigned int e = 0; e < VMS_NUM; e++) {
+			if (vm_cpustats[c][e] != 0) {
+				ncpus = c + 1;
 			}
 		}
 	}
-	lock_release(pagetable_lock);
-	return 0;
+
+	kprintf("%-28s %9s", "", "total");
+	for (unsigned int c = 0; c < ncpus; c++) {
+		kprintf("    cpu%-2u", c);
+	}
+	kprintf("\n");
+	for (unsigned int e = 0; e < VMS_NUM; e++) {
+		unsigned int total = 0;
+		for (unsigned int c = 0; c < ncpus; c++) {
+			total += vm_cpustats[c][e];
+		}
+		kprintf("%-28s %9u", vm_eventnames[e], total);
+		for (unsigned int c = 0; c < ncpus; c++) {
+			kprintf(" %9u", vm_cpustats[c][e]);
+		}
+		kprintf("\n");
+	}
+
+	ft_printstats();
+	pc_printstats();
+}
+
+// turns the summary printed when each process exits on or off
+void
+vm_setexitstats(bool enabled)
+{
+	vm_exitstats = enabled;
+}
+
+// prints a one process summary of its VM counters, if turned on
+void
+vm_printproc(const char *name, struct addrspace *as)
+{
+	if (!vm_exitstats || as == NULL) {
+		return;
+	}
+
+	unsigned int leaves = 0;
+	lock_acquire(as->pt_lock);
+	for (unsigned int i = 0; i < PT_DIR_SIZE; i++) {
+		if (as->pagetable[i] != NULL) {
+			leaves++;
+		}
+	}
+	lock_release(as->pt_lock);
+
+	unsigned int *s = as->vmstats;
+	kprintf("vm: %s: %u misses (%u refilled), faults %u read %u write "
+		"%u readonly\n", name, s[VMS_TLBMISS], s[VMS_REFILL],
+		s[VMS_FAULT_READ], s[VMS_FAULT_WRITE], s[VMS_FAULT_READONLY]);
+	kprintf("vm: %s: pages %u zero %u file %u cached %u runs, "
+		"%u swapped in %u out %u dropped, %u copies, "
+		"%u page table leaves\n", name, s[VMS_ZEROFILL],
+		s[VMS_FILEREAD], s[VMS_CACHEHIT], s[VMS_RUN], s[VMS_SWAPIN],
+		s[VMS_SWAPOUT], s[VMS_DROP], s[VMS_COPY], leaves);
+}
+
+// gives an address space an ID if it doesn't have a current one, and
+// makes it the one this cpu's TLB matches against
+void
+vm_activate(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+	if (as->asid >> ASID_BITS != asid_generation) {
+		if (asid_next == ASID_COUNT) {
+			// out of IDs, each cpu flushes before it uses the new ones
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->asid = (asid_generation << ASID_BITS) | asid_next++;
+	}
+	struct cpu *c = curcpu->c_self;
+	c->c_asid = (as->asid & (ASID_COUNT - 1)) << TLBHI_PIDSHIFT;
+	c->c_vmspace = as;
+	if (c->c_asidgen != asid_generation) {
+		// our entries may have IDs that are being handed out again
+		vm_tlbflush();
+		c->c_asidgen = asid_generation;
+	}
+	tlb_setpid(c->c_asid);
+	spinlock_release(&asid_lock);
+}
+
+/*
+ * Removes the entry for a page of an address space from the TLB of this
+ * cpu, if it has one, or with TS_ALLPAGES every entry of the address
+ * space, or with a NULL address space every entry. The address space's
+ * entries here have its current ID if this cpu has reached that ID's
+ * generation, and if it is the address space this cpu last activated,
+ * they can also have the ID it had then, which it keeps using until it
+ * activates another one.
+ */
+static
+void
+vm_tlbdrop(struct addrspace *as, vaddr_t page)
+{
+	uint32_t pids[2];
+	unsigned int npids = 0;
+
+	if (as == NULL) {
+		vm_tlbflush();
+		return;
+	}
+
+	spinlock_acquire(&asid_lock);
+	struct cpu *c = curcpu->c_self;
+	if (as->asid >> ASID_BITS == c->c_asidgen) {
+		pids[npids++] = (as->asid & (ASID_COUNT - 1)) << TLBHI_PIDSHIFT;
+	}
+	if (c->c_vmspace == as && (npids == 0 || pids[0] != c->c_asid)) {
+		pids[npids++] = c->c_asid;
+	}
+	for (unsigned int n = 0; n < npids; n++) {
+		if (page != TS_ALLPAGES) {
+			int slot = tlb_probe(page | pids[n], 0);
+			if (slot >= 0) {
+				tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+			}
+			continue;
+		}
+		for (int slot = 0; slot < NUM_TLB; slot++) {
+			uint32_t ehi, elo;
+			tlb_read(&ehi, &elo, slot);
+			if ((ehi & TLBHI_PID) == pids[n]) {
+				tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+			}
+		}
+	}
+	tlb_setpid(c->c_asid);
+	spinlock_release(&asid_lock);
+}
+
+// drops a page, all of an address space, or everything, from the TLB of
+// every cpu and waits until they have done it; may sleep, so it can't be
+// called with a spinlock held
+static
+void
+vm_shootdown(struct addrspace *as, vaddr_t page)
+{
+	struct tlbshootdown ts = { .ts_as = as, .ts_page = page };
+
+	lock_acquire(ts_lock);
+	// the current cpu can't change between doing it here and sending
+	int spl = splhigh();
+	vm_tlbdrop(as, page);
+	unsigned int n = ipi_tlbshootdown_broadcast(&ts);
+	splx(spl);
+	while (n-- > 0) {
+		P(ts_sem);
+	}
+	lock_release(ts_lock);
 }
 
-// calculates hash from the pid and virtual address
-uint32_t
-hpt_hash(uint32_t pid, vaddr_t faultaddr)
+// removes the TLB entries for a page of an address space on every cpu
+void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t page)
+{
+	vm_shootdown(as, page);
+}
+
+// invalidates every entry in the TLB of the current cpu
+void
+vm_tlbflush(void)
 {
-	uint32_t index = ((pid) ^ (faultaddr >> PAGE_BITS)) % num_pages;
-	return index;
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	int spl = splhigh();
+
+	for (int i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(curcpu->c_asid);
+
+	splx(spl);
 }
 
-// returns the index of the pte for a given address and pid, or finds the closest empty slot
-uint32_t
-hpt_indexof(uint32_t pid, vaddr_t faultaddr)
+// sets up an empty page table for a new address space
+int
+vm_initproc(struct addrspace *as)
 {
-	uint32_t index = hpt_hash(pid, faultaddr);
-	if (pagetable[index].pid == 0) {
-		// hash location is free, so use that
-		return index;
+	as->pagetable = kmalloc(sizeof(struct pte *) * PT_DIR_SIZE);
+	if (as->pagetable == NULL) {
+		return ENOMEM;
+	}
+	for (unsigned int i = 0; i < PT_DIR_SIZE; i++) {
+		as->pagetable[i] = NULL;
+	}
+
+	as->pt_lock = lock_create("pt_lock");
+	if (as->pt_lock == NULL) {
+		kfree(as->pagetable);
+		return ENOMEM;
 	}
-	for (; pagetable[index].pid != pid || pagetable[index].page != faultaddr; index++) {
-		if (pagetable[index].pid == 0) {
-			// space found
-			return index;
+	return 0;
+}
+
+// frees the page table of an address space and the frames in use by it
+void
+vm_freeproc(struct addrspace *as)
+{
+	// wait for any eviction that picked one of our pages
+	lock_acquire(evict_lock);
+	lock_acquire(as->pt_lock);
+	for (unsigned int i = 0; i < PT_DIR_SIZE; i++) {
+		struct pte *leaf = as->pagetable[i];
+		if (leaf == NULL) {
+			continue;
+		}
+		for (unsigned int j = 0; j < PT_LEAF_SIZE; j++) {
+			if (leaf[j].slot != SWAP_NOSLOT) {
+				swap_free(leaf[j].slot);
+			}
+			if (leaf[j].frame != 0) {
+				// only releases the frame once no other process shares it
+				free_kpages(leaf[j].frame);
+			}
 		}
-		if (index == num_pages) {
-			// reached end of array, loop back to beginning
-			index = 0;
+		kfree(leaf);
+	}
+	lock_release(as->pt_lock);
+	lock_release(evict_lock);
+
+	lock_destroy(as->pt_lock);
+	kfree(as->pagetable);
+}
+
+// frees the pages in [start, end) of an address space, which must be
+// page aligned, along with their swap slots and TLB entries
+void
+vm_freerange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	KASSERT((start & PAGE_FRAME) == start);
+	KASSERT((end & PAGE_FRAME) == end);
+
+	lock_acquire(as->pt_lock);
+	for (vaddr_t page = start; page < end; page += PAGE_SIZE) {
+		struct pte *pte = pt_lookup(as, page, false);
+		if (pte == NULL) {
 			continue;
 		}
-		if (index == index) {
-			// traversed through whole array, no free space left
-			return num_pages;
+		if (pte->slot != SWAP_NOSLOT) {
+			swap_free(pte->slot);
+			pte->slot = SWAP_NOSLOT;
 		}
+		if (pte->frame != 0) {
+			// an eviction that picked this frame will see it's gone
+			vm_tlbinvalidate(as, page);
+			free_kpages(pte->frame);
+			pte->frame = 0;
+		}
+		pte->written = 0;
 	}
-	// pte matching input found
-	return index;
+	lock_release(as->pt_lock);
 }
 
 /*
- *
- * SMP-specific functions.  Unused in our configuration.
+ * Writes the pages of a file mapping that this address space has written
+ * back to the file, whether they are in memory or in swap. Pages a
+ * forked child only inherited are left alone, since their frames may be
+ * dirty with the parent's writes. The file's pages in the page cache are
+ * dropped afterwards.
  */
+int
+vm_writeback(struct addrspace *as, struct region *reg)
+{
+	KASSERT(reg->vnode != NULL);
+	KASSERT((reg->filebase & PAGE_FRAME) == reg->filebase);
+
+	// pages in swap are read back into this rather than a new frame,
+	// which could mean evicting a page while holding our lock
+	char *buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	int result = 0;
+	bool wrote = false;
+	vaddr_t fileend = reg->filebase + reg->filesize;
+	lock_acquire(as->pt_lock);
+	for (vaddr_t page = reg->filebase; page < fileend; page += PAGE_SIZE) {
+		struct pte *pte = pt_lookup(as, page, false);
+		if (pte == NULL) {
+			continue;
+		}
+
+		void *data;
+		if (!pte->written) {
+			// never written by us, the file already has it
+			continue;
+		} else if (pte->frame != 0) {
+			data = (void *)pte->frame;
+		} else {
+			KASSERT(pte->slot != SWAP_NOSLOT);
+			result = swap_in(pte->slot, (vaddr_t)buf);
+			if (result) {
+				break;
+			}
+			data = buf;
+		}
+
+		struct iovec iov;
+		struct uio u;
+		size_t len = fileend - page < PAGE_SIZE ? fileend - page : PAGE_SIZE;
+		uio_kinit(&iov, &u, data, len,
+			reg->offset + (page - reg->filebase), UIO_WRITE);
+		wrote = true;
+		result = VOP_WRITE(reg->vnode, &u);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(as->pt_lock);
+
+	if (wrote) {
+		// read-only mappings and execs of the file must not get old pages
+		pc_invalidate(reg->vnode);
+	}
+
+	kfree(buf);
+	return result;
+}
+
+// shares the pages of one address space with another, copy-on-write
+int
+vm_cloneproc(struct addrspace *old, struct addrspace *new)
+{
+	int result = 0;
+
+	lock_acquire(old->pt_lock);
+	lock_acquire(new->pt_lock);
+	for (unsigned int i = 0; i < PT_DIR_SIZE && result == 0; i++) {
+		struct pte *leaf = old->pagetable[i];
+		if (leaf == NULL) {
+			continue;
+		}
+		for (unsigned int j = 0; j < PT_LEAF_SIZE; j++) {
+			if (leaf[j].frame == 0 && leaf[j].slot == SWAP_NOSLOT) {
+				continue;
+			}
+			vaddr_t page = (i << (PAGE_BITS + PT_LEAF_BITS)) | (j << PAGE_BITS);
+			struct pte *pte = pt_lookup(new, page, true);
+			if (pte == NULL) {
+				result = ENOMEM;
+				break;
+			}
+			if (leaf[j].slot != SWAP_NOSLOT) {
+				// slots can't be shared, give the child its own. A clean
+				// resident page needs one too, since eviction drops it
+				// without writing and relies on the slot
+				unsigned int slot;
+				result = swap_dup(leaf[j].slot, &slot);
+				if (result) {
+					break;
+				}
+				pte->slot = slot;
+			}
+			if (leaf[j].frame != 0) {
+				ft_incref(leaf[j].frame);
+				pte->frame = leaf[j].frame;
+			}
+		}
+	}
+	lock_release(new->pt_lock);
+	lock_release(old->pt_lock);
+
+	// the parent may still have writable TLB entries for the shared
+	// frames, on any cpu it has run on
+	vm_shootdown(old, TS_ALLPAGES);
+	// on failure, as_destroy() releases whatever was shared already
+	return result;
+}
 
+// does a shootdown sent by vm_shootdown() on another cpu, called from
+// interprocessor_interrupt()
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	vm_tlbdrop(ts->ts_as, ts->ts_page);
+	V(ts_sem);
 }
 